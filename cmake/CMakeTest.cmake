@@ -82,6 +82,18 @@ foreach(ext ${extensions_4})
   )
 endforeach()
 
+# batch signing: a single key/certificate load for all manifest entries
+set(batch_manifest "${FILES}/batch.txt")
+file(WRITE "${batch_manifest}" "")
+foreach(ext ${extensions_3})
+  file(APPEND "${batch_manifest}" "${FILES}/unsigned.${ext} ${FILES}/batch.${ext}\n")
+endforeach()
+add_test(
+  NAME signed_batch
+  COMMAND osslsigncode "sign-batch" ${sign_opt} ${priv_p12}
+    "-in" "${batch_manifest}"
+)
+
 foreach(ext ${extensions_3})
   add_test(
     NAME removed_${ext}
@@ -193,6 +205,41 @@ foreach(file ${files_3})
   endforeach()
 endforeach()
 
+foreach(ext ${extensions_3})
+  # Signature verification time: Sep  1 00:00:00 2019 GMT
+  add_test(
+    NAME verify_batch_${ext}
+    COMMAND osslsigncode "verify" ${verify_opt}
+      "-time" "1567296000"
+      "-require-leaf-hash" "SHA256:${leafhash}"
+      "-in" "${FILES}/batch.${ext}"
+  )
+  set_tests_properties(verify_batch_${ext} PROPERTIES
+    DEPENDS signed_batch
+    REQUIRED_FILES "${FILES}/batch.${ext}"
+  )
+endforeach()
+
+# batch verification: one manifest run over all the signed files
+set(verify_manifest "${FILES}/verify-batch.txt")
+file(WRITE "${verify_manifest}" "")
+foreach(ext ${extensions_4})
+  file(APPEND "${verify_manifest}" "${FILES}/signed.${ext}\n")
+endforeach()
+# Signature verification time: Sep  1 00:00:00 2019 GMT
+add_test(
+  NAME verified_batch
+  COMMAND osslsigncode "verify-batch" ${verify_opt}
+    "-time" "1567296000"
+    "-require-leaf-hash" "SHA256:${leafhash}"
+    "-in" "${verify_manifest}"
+)
+set_tests_properties(verified_batch PROPERTIES
+  DEPENDS "signed_exe;signed_ex_;signed_msi;signed_cat"
+  REQUIRED_FILES "${FILES}/signed.exe"
+  REQUIRED_FILES "${FILES}/signed.cat"
+)
+
 foreach(ext ${extensions_3})
   set_tests_properties(verify_removed_${ext} PROPERTIES
     WILL_FAIL TRUE
@@ -295,4 +342,7 @@ foreach(ext ${extensions_4})
   set(OUTPUT_FILES ${OUTPUT_FILES} "${FILES}/jreq.tsq")
   set(OUTPUT_FILES ${OUTPUT_FILES} "${FILES}/jresp.tsr")
 endforeach()
+foreach(ext ${extensions_3})
+  set(OUTPUT_FILES ${OUTPUT_FILES} "${FILES}/batch.${ext}")
+endforeach()
 add_test(NAME remove_files COMMAND ${CMAKE_COMMAND} -E rm -f ${OUTPUT_FILES})
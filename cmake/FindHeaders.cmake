@@ -8,6 +8,7 @@ if(UNIX)
   if(HAVE_SYS_MMAN_H)
     check_function_exists(mmap HAVE_MMAP)
   endif(HAVE_SYS_MMAN_H)
+  check_include_file(pthread.h HAVE_PTHREAD_H)
 else(UNIX)
   check_include_file(windows.h HAVE_MAPVIEWOFFILE)
 endif(UNIX)
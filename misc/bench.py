@@ -0,0 +1,223 @@
+#!/usr/bin/python3
+"""Performance benchmarks for osslsigncode.
+
+Generates a synthetic corpus (PE images of configurable size and section
+count, CFB/MSI containers with a configurable stream distribution and an
+extended CAB archive) and times the signing paths that dominate runtime:
+the Authenticode digest for each file type, the PE page hash and the MSI
+directory hash.  Results are reported in MB/s so releases can be compared.
+
+Run through the build system:  cmake --build . --target osslsigncode-bench
+"""
+
+import argparse
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import time
+
+SECTOR_SIZE = 512
+FAT_PER_SECTOR = SECTOR_SIZE // 4
+DIRENT_SIZE = 128
+ENDOFCHAIN = 0xfffffffe
+FATSECT = 0xfffffffd
+DIFSECT = 0xfffffffc
+FREESECT = 0xffffffff
+NOSTREAM = 0xffffffff
+
+
+def align(n, a):
+    return (n + a - 1) & ~(a - 1)
+
+
+def make_pe(path, size, nsections):
+    """Write a minimal PE32+ image of roughly the requested size."""
+    opt_size = 112 + 16 * 8          # PE32+ optional header, 16 data directories
+    headers_end = 64 + 4 + 20 + opt_size + 40 * nsections
+    size_of_headers = align(headers_end, 512)
+    payload = max(size - size_of_headers, nsections * 512)
+    per_section = align(payload // nsections, 512)
+
+    dos = b'MZ' + b'\0' * 58 + struct.pack('<I', 64)
+    coff = b'PE\0\0' + struct.pack('<HHIIIHH',
+        0x8664, nsections, 0, 0, 0, opt_size, 0x0022)
+
+    sections = b''
+    raw_ptr = size_of_headers
+    virt = 0x1000
+    for i in range(nsections):
+        name = ('.bench%d' % i).encode()[:8].ljust(8, b'\0')
+        sections += struct.pack('<8sIIIIIIHHI', name,
+            per_section, virt, per_section, raw_ptr, 0, 0, 0, 0, 0x40000040)
+        raw_ptr += per_section
+        virt = align(virt + per_section, 0x1000)
+
+    opt = struct.pack('<HBBIIIII', 0x20b, 14, 0, per_section, 0, 0, 0x1000, 0x1000)
+    opt += struct.pack('<QIIHHHHHHIIIIHHQQQQII',
+        0x140000000,                 # ImageBase
+        0x1000, 0x200,               # section/file alignment
+        6, 0, 0, 0, 6, 0, 0,         # versions
+        virt,                        # SizeOfImage
+        size_of_headers, 0,          # SizeOfHeaders, CheckSum
+        3, 0,                        # Subsystem, DllCharacteristics
+        0x100000, 0x1000, 0x100000, 0x1000,
+        0, 16)                       # LoaderFlags, NumberOfRvaAndSizes
+    opt += b'\0' * (16 * 8)          # empty data directories
+
+    with open(path, 'wb') as pe:
+        pe.write(dos + coff + opt + sections)
+        pe.write(b'\0' * (size_of_headers - headers_end))
+        chunk = bytes(range(256)) * 256
+        left = raw_ptr - size_of_headers
+        while left > 0:
+            pe.write(chunk[:min(left, len(chunk))])
+            left -= len(chunk)
+    return os.path.getsize(path)
+
+
+def make_msi(path, nstreams, stream_size):
+    """Write a version 3 CFB container with regular streams only."""
+    stream_size = max(stream_size, 4096)     # keep clear of the mini stream
+    sectors_per_stream = align(stream_size, SECTOR_SIZE) // SECTOR_SIZE
+    ndirsectors = align((1 + nstreams) * DIRENT_SIZE, SECTOR_SIZE) // SECTOR_SIZE
+
+    # sector layout: [DIFAT sectors][FAT sectors][directory sectors][stream sectors]
+    ndata = ndirsectors + nstreams * sectors_per_stream
+    nfat, ndifat = 1, 0
+    while True:
+        needed = align(ndifat + nfat + ndata, FAT_PER_SECTOR) // FAT_PER_SECTOR
+        difat_needed = align(max(needed - 109, 0), FAT_PER_SECTOR - 1) // (FAT_PER_SECTOR - 1)
+        if needed <= nfat and difat_needed <= ndifat:
+            break
+        nfat, ndifat = needed, difat_needed
+
+    fat = [DIFSECT] * ndifat + [FATSECT] * nfat
+    first_dir = ndifat + nfat
+    fat += [i + 1 for i in range(first_dir, first_dir + ndirsectors - 1)] + [ENDOFCHAIN]
+    first_stream = first_dir + ndirsectors
+    for i in range(nstreams):
+        start = first_stream + i * sectors_per_stream
+        fat += [start + j + 1 for j in range(sectors_per_stream - 1)] + [ENDOFCHAIN]
+    fat += [FREESECT] * (nfat * FAT_PER_SECTOR - len(fat))
+
+    # FAT sector locations, first 109 in the header, the rest in DIFAT sectors
+    fatlocs = [ndifat + i for i in range(nfat)]
+    difat = b''
+    for i in range(ndifat):
+        entries = fatlocs[109 + i * (FAT_PER_SECTOR - 1):
+            109 + (i + 1) * (FAT_PER_SECTOR - 1)]
+        entries += [FREESECT] * (FAT_PER_SECTOR - 1 - len(entries))
+        entries.append(i + 1 if i + 1 < ndifat else ENDOFCHAIN)
+        difat += struct.pack('<%dI' % FAT_PER_SECTOR, *entries)
+
+    def dirent(name, dtype, child, right, start, dsize):
+        uname = name.encode('utf-16-le') + b'\0\0'
+        return struct.pack('<64sHBBIII16sIQQIQ',
+            uname.ljust(64, b'\0'), len(uname), dtype, 1,
+            NOSTREAM, right, child, b'\0' * 16, 0, 0, 0, start, dsize)
+
+    dirents = dirent('Root Entry', 5, 1 if nstreams else NOSTREAM,
+        NOSTREAM, ENDOFCHAIN, 0)
+    for i in range(nstreams):
+        right = i + 2 if i + 1 < nstreams else NOSTREAM
+        dirents += dirent('Stream%04d' % i, 2, NOSTREAM, right,
+            first_stream + i * sectors_per_stream, stream_size)
+    dirents = dirents.ljust(ndirsectors * SECTOR_SIZE, b'\0')
+
+    header = b'\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1' + b'\0' * 16
+    header += struct.pack('<HHHHH6xIIIIIIIII',
+        0x3e, 0x03, 0xfffe, 0x0009, 0x0006,
+        0, nfat, first_dir,               # dir sectors (0 for v3), FAT sectors, first dir sector
+        0, 0x1000,                        # transaction, mini stream cutoff
+        ENDOFCHAIN, 0,                    # no mini FAT
+        0 if ndifat else ENDOFCHAIN, ndifat)
+    hdrfat = fatlocs[:109] + [FREESECT] * max(109 - nfat, 0)
+    header += struct.pack('<109I', *hdrfat)
+
+    with open(path, 'wb') as msi:
+        msi.write(header)
+        msi.write(difat)
+        msi.write(struct.pack('<%dI' % len(fat), *fat))
+        msi.write(dirents)
+        chunk = bytes(range(256)) * 256
+        for i in range(nstreams):
+            left = sectors_per_stream * SECTOR_SIZE
+            while left > 0:
+                msi.write(chunk[:min(left, len(chunk))])
+                left -= len(chunk)
+    return os.path.getsize(path)
+
+
+def make_cab(template, path, size):
+    """Extend the unsigned test CAB to the requested size."""
+    with open(template, 'rb') as cab:
+        data = bytearray(cab.read())
+    pad = max(size - len(data), 0)
+    struct.pack_into('<I', data, 8, len(data) + pad)     # cbCabinet
+    with open(path, 'wb') as cab:
+        cab.write(data)
+        cab.write(b'\0' * pad)
+    return os.path.getsize(path)
+
+
+def bench(name, osslsigncode, sign_args, infile, outfile, size):
+    if os.path.exists(outfile):
+        os.remove(outfile)
+    start = time.monotonic()
+    proc = subprocess.run([osslsigncode, 'sign'] + sign_args +
+        ['-in', infile, '-out', outfile],
+        stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    elapsed = time.monotonic() - start
+    if proc.returncode:
+        sys.stdout.write(proc.stdout.decode())
+        sys.exit('%s: signing failed' % name)
+    mb = size / (1024.0 * 1024.0)
+    print('%-24s %8.1f MB %8.2f s %10.1f MB/s' % (name, mb, elapsed, mb / elapsed))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--osslsigncode', required=True)
+    parser.add_argument('--certs', required=True,
+        help='directory with the test certificates (Testing/certs)')
+    parser.add_argument('--files', required=True,
+        help='directory with the test files (Testing/files)')
+    parser.add_argument('--workdir', required=True)
+    parser.add_argument('--pe-size', type=int, default=256 * 1024 * 1024)
+    parser.add_argument('--pe-sections', type=int, default=4)
+    parser.add_argument('--cab-size', type=int, default=256 * 1024 * 1024)
+    parser.add_argument('--msi-streams', type=int, default=64)
+    parser.add_argument('--msi-stream-size', type=int, default=4 * 1024 * 1024)
+    parser.add_argument('--keep', action='store_true',
+        help='keep the generated corpus and the signed files')
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    sign_args = ['-pkcs12', os.path.join(args.certs, 'cert.p12'),
+        '-readpass', os.path.join(args.certs, 'password.txt'),
+        '-time', '1556708400']
+
+    pe = os.path.join(args.workdir, 'bench.exe')
+    cab = os.path.join(args.workdir, 'bench.ex_')
+    msi = os.path.join(args.workdir, 'bench.msi')
+    pe_size = make_pe(pe, args.pe_size, args.pe_sections)
+    cab_size = make_cab(os.path.join(args.files, 'unsigned.ex_'), cab, args.cab_size)
+    msi_size = make_msi(msi, args.msi_streams, args.msi_stream_size)
+
+    print('%-24s %11s %10s %13s' % ('benchmark', 'size', 'time', 'throughput'))
+    bench('pe-digest', args.osslsigncode, sign_args, pe, pe + '.signed', pe_size)
+    bench('pe-page-hash', args.osslsigncode, sign_args + ['-ph'],
+        pe, pe + '.ph.signed', pe_size)
+    bench('cab-digest', args.osslsigncode, sign_args, cab, cab + '.signed', cab_size)
+    bench('msi-digest', args.osslsigncode, sign_args, msi, msi + '.signed', msi_size)
+    bench('msi-dir-hash', args.osslsigncode, sign_args + ['-add-msi-dse'],
+        msi, msi + '.dse.signed', msi_size)
+
+    if not args.keep:
+        shutil.rmtree(args.workdir)
+
+
+if __name__ == '__main__':
+    main()
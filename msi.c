@@ -10,13 +10,22 @@
  * https://github.com/microsoft/compoundfilereader
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
 #include <string.h>       /* memcmp */
+#ifdef HAVE_SYS_MMAN_H
+#include <unistd.h>       /* sysconf */
+#include <sys/mman.h>     /* madvise */
+#endif /* HAVE_SYS_MMAN_H */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
 #include "msi.h"
 
 #define MIN(a,b) ((a) < (b) ? a : b)
 
-static int recurse_entry(MSI_FILE *msi, uint32_t entryID, MSI_DIRENT *parent);
-
 /* Get absolute address from sector and offset */
 static const u_char *sector_offset_to_address(MSI_FILE *msi, uint32_t sector, uint32_t offset)
 {
@@ -61,9 +70,18 @@ static uint32_t get_fat_sector_location(MSI_FILE *msi, uint32_t fatSectorNumber)
 static uint32_t get_next_sector(MSI_FILE *msi, uint32_t sector)
 {
 	const u_char *address;
-	uint32_t entriesPerSector = msi->m_sectorSize / 4;
-	uint32_t fatSectorNumber = sector / entriesPerSector;
-	uint32_t fatSectorLocation = get_fat_sector_location(msi, fatSectorNumber);
+	uint32_t entriesPerSector, fatSectorNumber, fatSectorLocation;
+
+	if (msi->m_fatChain) {
+		if (sector >= msi->m_fatChainLen) {
+			printf("Corrupted file\n");
+			return NOSTREAM; /* FAILED */
+		}
+		return msi->m_fatChain[sector];
+	}
+	entriesPerSector = msi->m_sectorSize / 4;
+	fatSectorNumber = sector / entriesPerSector;
+	fatSectorLocation = get_fat_sector_location(msi, fatSectorNumber);
 	if (fatSectorLocation == NOSTREAM) {
 		printf("Failed to get a fat sector location\n");
 		return NOSTREAM; /* FAILED */
@@ -76,6 +94,132 @@ static uint32_t get_next_sector(MSI_FILE *msi, uint32_t sector)
 	return GET_UINT32_LE(address);
 }
 
+/*
+ * Build a one-time FAT lookup table, so every get_next_sector() call becomes
+ * a direct lookup instead of a DIFAT/FAT chain walk.  Reading a stream was
+ * quadratic in its sector count without it.
+ */
+static int load_fat_chain(MSI_FILE *msi)
+{
+	uint32_t i, j;
+	uint32_t entriesPerSector = msi->m_sectorSize / 4;
+
+	if (msi->m_hdr->numFATSector == 0
+			|| msi->m_hdr->numFATSector > msi->m_bufferLen / msi->m_sectorSize) {
+		return 0; /* FAILED */
+	}
+	msi->m_fatChain = OPENSSL_malloc((uint64_t)msi->m_hdr->numFATSector * msi->m_sectorSize);
+	msi->m_fatChainLen = msi->m_hdr->numFATSector * entriesPerSector;
+	for (i = 0; i < msi->m_hdr->numFATSector; i++) {
+		const u_char *address;
+		uint32_t fatSectorLocation = get_fat_sector_location(msi, i);
+		if (fatSectorLocation == NOSTREAM
+				|| !(address = sector_offset_to_address(msi, fatSectorLocation, 0))) {
+			OPENSSL_free(msi->m_fatChain);
+			msi->m_fatChain = NULL;
+			msi->m_fatChainLen = 0;
+			return 0; /* FAILED */
+		}
+		for (j = 0; j < entriesPerSector; j++) {
+			msi->m_fatChain[i * entriesPerSector + j] = GET_UINT32_LE(address + 4 * j);
+		}
+	}
+	return 1; /* OK */
+}
+
+/* Build a one-time mini FAT lookup table for get_next_mini_sector() */
+static int load_minifat_chain(MSI_FILE *msi)
+{
+	uint32_t i, j;
+	uint32_t entriesPerSector = msi->m_sectorSize / 4;
+	uint32_t sector = msi->m_hdr->firstMiniFATSectorLocation;
+
+	if (msi->m_hdr->numMiniFATSector == 0) {
+		return 1; /* OK, no mini FAT */
+	}
+	if (msi->m_hdr->numMiniFATSector > msi->m_bufferLen / msi->m_sectorSize) {
+		return 0; /* FAILED */
+	}
+	msi->m_minifatChain = OPENSSL_malloc((uint64_t)msi->m_hdr->numMiniFATSector * msi->m_sectorSize);
+	msi->m_minifatChainLen = msi->m_hdr->numMiniFATSector * entriesPerSector;
+	for (i = 0; i < msi->m_hdr->numMiniFATSector; i++) {
+		const u_char *address;
+		if (sector == ENDOFCHAIN || sector == NOSTREAM
+				|| !(address = sector_offset_to_address(msi, sector, 0))) {
+			OPENSSL_free(msi->m_minifatChain);
+			msi->m_minifatChain = NULL;
+			msi->m_minifatChainLen = 0;
+			return 0; /* FAILED */
+		}
+		for (j = 0; j < entriesPerSector; j++) {
+			msi->m_minifatChain[i * entriesPerSector + j] = GET_UINT32_LE(address + 4 * j);
+		}
+		sector = get_next_sector(msi, sector);
+	}
+	return 1; /* OK */
+}
+
+/*
+ * Resolve the sector chain of the mini stream once, so the double
+ * indirection in mini_sector_offset_to_address() becomes a direct lookup.
+ */
+static int load_ministream_chain(MSI_FILE *msi)
+{
+	uint32_t count = 0;
+	uint32_t totalSectors = msi->m_bufferLen / msi->m_sectorSize;
+	uint32_t sector = msi->m_miniStreamStartSector;
+
+	if (sector == ENDOFCHAIN || sector == NOSTREAM) {
+		return 1; /* OK, no mini stream */
+	}
+	msi->m_ministreamChain = OPENSSL_malloc((uint64_t)totalSectors * sizeof(uint32_t));
+	while (sector != ENDOFCHAIN) {
+		/* a chain longer than the file detects a cycle */
+		if (sector == NOSTREAM || count >= totalSectors) {
+			OPENSSL_free(msi->m_ministreamChain);
+			msi->m_ministreamChain = NULL;
+			msi->m_ministreamChainLen = 0;
+			return 0; /* FAILED */
+		}
+		msi->m_ministreamChain[count++] = sector;
+		sector = get_next_sector(msi, sector);
+	}
+	msi->m_ministreamChainLen = count;
+	return 1; /* OK */
+}
+
+/*
+ * Index the address of every sector of the directory chain once, so each
+ * get_entry() call becomes a direct lookup instead of a walk over the
+ * directory chain from its first sector.
+ */
+static int load_directory_chain(MSI_FILE *msi)
+{
+	uint32_t count = 0;
+	uint32_t totalSectors = msi->m_bufferLen / msi->m_sectorSize;
+	uint32_t sector = msi->m_hdr->firstDirectorySectorLocation;
+
+	if (sector == ENDOFCHAIN || sector == NOSTREAM) {
+		return 0; /* FAILED */
+	}
+	msi->m_dirSectors = OPENSSL_malloc((uint64_t)totalSectors * sizeof(const u_char *));
+	while (sector != ENDOFCHAIN) {
+		const u_char *address;
+		/* a chain longer than the file detects a cycle */
+		if (sector == NOSTREAM || count >= totalSectors
+				|| !(address = sector_offset_to_address(msi, sector, 0))) {
+			OPENSSL_free(msi->m_dirSectors);
+			msi->m_dirSectors = NULL;
+			msi->m_dirSectorCount = 0;
+			return 0; /* FAILED */
+		}
+		msi->m_dirSectors[count++] = address;
+		sector = get_next_sector(msi, sector);
+	}
+	msi->m_dirSectorCount = count;
+	return 1; /* OK */
+}
+
 /* Locate the final sector/offset when original offset expands multiple sectors */
 static int locate_final_sector(MSI_FILE *msi, uint32_t sector, uint32_t offset, uint32_t *finalSector, uint32_t *finalOffset)
 {
@@ -92,14 +236,42 @@ static int locate_final_sector(MSI_FILE *msi, uint32_t sector, uint32_t offset,
 	return 1; /* OK */
 }
 
+/*
+ * The mini FAT and mini stream tables are only needed once a stream below
+ * the cutoff size is accessed, so they are built on first use; extracting
+ * the signature of a large file may not touch them at all.
+ */
+static void ensure_mini_chains(MSI_FILE *msi)
+{
+	if (msi->m_miniChainsLoaded)
+		return;
+	msi->m_miniChainsLoaded = 1;
+	if (!load_minifat_chain(msi)) {
+		printf("Warning: Failed to build a mini FAT lookup table\n");
+	}
+	if (!load_ministream_chain(msi)) {
+		printf("Warning: Failed to build a mini stream lookup table\n");
+	}
+}
+
 /* Get absolute address from mini sector and offset */
 static const u_char *mini_sector_offset_to_address(MSI_FILE *msi, uint32_t sector, uint32_t offset)
 {
+	ensure_mini_chains(msi);
 	if (sector >= MAXREGSECT || offset >= msi->m_minisectorSize ||
 			(msi->m_bufferLen - offset) / msi->m_minisectorSize <= sector) {
 		printf("Corrupted file\n");
 		return NULL; /* FAILED */
 	}
+	if (msi->m_ministreamChain) {
+		uint32_t streamOffset = sector * msi->m_minisectorSize + offset;
+		if (streamOffset / msi->m_sectorSize >= msi->m_ministreamChainLen) {
+			printf("Corrupted file\n");
+			return NULL; /* FAILED */
+		}
+		return sector_offset_to_address(msi, msi->m_ministreamChain[streamOffset / msi->m_sectorSize],
+			streamOffset % msi->m_sectorSize);
+	}
 	if (!locate_final_sector(msi, msi->m_miniStreamStartSector, sector * msi->m_minisectorSize + offset, &sector, &offset)) {
 		printf("Failed to locate a final sector\n");
 		return NULL; /* FAILED */
@@ -149,6 +321,14 @@ static uint32_t get_next_mini_sector(MSI_FILE *msi, uint32_t miniSector)
 	uint32_t sector, offset;
 	const u_char *address;
 
+	ensure_mini_chains(msi);
+	if (msi->m_minifatChain) {
+		if (miniSector >= msi->m_minifatChainLen) {
+			printf("Corrupted file\n");
+			return NOSTREAM; /* FAILED */
+		}
+		return msi->m_minifatChain[miniSector];
+	}
 	if (!locate_final_sector(msi, msi->m_hdr->firstMiniFATSectorLocation, miniSector * 4, &sector, &offset)) {
 		printf("Failed to locate a final sector\n");
 		return NOSTREAM; /* FAILED */
@@ -301,11 +481,57 @@ static MSI_FILE_HDR *parse_header(char *data)
 	return header;
 }
 
+/*
+ * Per-file bump allocator for the directory metadata.  A large MSI
+ * yields one MSI_ENTRY and one MSI_DIRENT per directory entry; carving
+ * them out of arena blocks replaces hundreds of thousands of small
+ * heap allocations with a handful of block allocations that are freed
+ * wholesale with the MSI_FILE.
+ */
+#define ARENA_BLOCK_SIZE 0x10000
+
+struct msi_arena_block {
+	struct msi_arena_block *next;
+	size_t used;
+	size_t size;
+	u_char data[];
+};
+
+static void *arena_alloc(MSI_ARENA **arena, size_t size)
+{
+	MSI_ARENA *block = *arena;
+	void *ret;
+
+	size = (size + 15) & ~(size_t)15; /* keep allocations aligned */
+	if (!block || block->used + size > block->size) {
+		size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+
+		block = OPENSSL_malloc(sizeof(MSI_ARENA) + blockSize);
+		block->next = *arena;
+		block->used = 0;
+		block->size = blockSize;
+		*arena = block;
+	}
+	ret = block->data + block->used;
+	block->used += size;
+	return ret;
+}
+
+static void arena_free(MSI_ARENA *arena)
+{
+	while (arena) {
+		MSI_ARENA *next = arena->next;
+
+		OPENSSL_free(arena);
+		arena = next;
+	}
+}
+
 /* Parse MSI_ENTRY struct */
 static MSI_ENTRY *parse_entry(MSI_FILE *msi, const u_char *data, int is_root)
 {
 	uint32_t inlen;
-	MSI_ENTRY *entry = (MSI_ENTRY *)OPENSSL_malloc(sizeof(MSI_ENTRY));
+	MSI_ENTRY *entry = (MSI_ENTRY *)arena_alloc(&msi->m_arena, sizeof(MSI_ENTRY));
 
 	/* initialise 128 bytes */
 	memset(entry, 0, sizeof(MSI_ENTRY));
@@ -313,7 +539,6 @@ static MSI_ENTRY *parse_entry(MSI_FILE *msi, const u_char *data, int is_root)
 	/* This length MUST NOT exceed 64, the maximum size of the Directory Entry Name field */
 	if (entry->nameLen == 0 || entry->nameLen > 64) {
 		printf("Corrupted Directory Entry Name Length\n");
-		OPENSSL_free(entry);
 		return NULL; /* FAILED */
 	}
 	memcpy(entry->name, data + DIRENT_NAME, entry->nameLen);
@@ -321,7 +546,6 @@ static MSI_ENTRY *parse_entry(MSI_FILE *msi, const u_char *data, int is_root)
 	 * string "Root Entry" in Unicode UTF-16. */
 	if (is_root && memcmp(entry->name, msi_root_entry, entry->nameLen)) {
 		printf("Corrupted Root Directory Entry's Name\n");
-		OPENSSL_free(entry);
 		return NULL; /* FAILED */
 	}
 	entry->type = GET_UINT8_LE(data + DIRENT_TYPE);
@@ -336,7 +560,6 @@ static MSI_ENTRY *parse_entry(MSI_FILE *msi, const u_char *data, int is_root)
 	   but the Modified Time field in the root storage directory entry MAY be all zeroes */
 	if (is_root && memcmp(entry->creationTime, msi_zeroes, 8)) {
 		printf("Corrupted Root Directory Entry's Creation Time\n");
-		OPENSSL_free(entry);
 		return NULL; /* FAILED */
 	}
 	memcpy(entry->modifiedTime, data + DIRENT_MODIFY_TIME, 8);
@@ -348,7 +571,6 @@ static MSI_ENTRY *parse_entry(MSI_FILE *msi, const u_char *data, int is_root)
 	if ((msi->m_sectorSize == 0x0200 && inlen > 0x80000000)
 			|| (msi->m_bufferLen <= inlen)) {
 		printf("Corrupted Stream Size 0x%08X\n", inlen);
-		OPENSSL_free(entry);
 		return NULL; /* FAILED */
 	}
 	return entry;
@@ -380,6 +602,15 @@ static MSI_ENTRY *get_entry(MSI_FILE *msi, uint32_t entryID, int is_root)
 		printf("Corrupted First Directory Sector Location\n");
 		return NULL; /* FAILED */
 	}
+	if (msi->m_dirSectors) {
+		uint32_t streamOffset = entryID * (uint32_t)sizeof(MSI_ENTRY);
+		if (streamOffset / msi->m_sectorSize >= msi->m_dirSectorCount) {
+			printf("Invalid argument entryID\n");
+			return NULL; /* FAILED */
+		}
+		return parse_entry(msi, msi->m_dirSectors[streamOffset / msi->m_sectorSize]
+			+ streamOffset % msi->m_sectorSize, is_root);
+	}
 	if (!locate_final_sector(msi, msi->m_hdr->firstDirectorySectorLocation,
 			entryID * sizeof(MSI_ENTRY), &sector, &offset)) {
 		printf("Failed to locate a final sector\n");
@@ -421,6 +652,16 @@ MSI_FILE *msi_file_new(char *buffer, uint32_t len)
 	msi->m_sectorSize = 1 << msi->m_hdr->sectorShift;
 	msi->m_minisectorSize = 1 << msi->m_hdr->miniSectorShift;
 	msi->m_miniStreamStartSector = 0;
+	msi->m_fatChain = NULL;
+	msi->m_fatChainLen = 0;
+	msi->m_minifatChain = NULL;
+	msi->m_minifatChainLen = 0;
+	msi->m_ministreamChain = NULL;
+	msi->m_ministreamChainLen = 0;
+	msi->m_dirSectors = NULL;
+	msi->m_dirSectorCount = 0;
+	msi->m_miniChainsLoaded = 0;
+	msi->m_arena = NULL;
 
 	if (msi->m_bufferLen < sizeof *(msi->m_hdr) ||
 			memcmp(msi->m_hdr->signature, msi_magic, sizeof msi_magic)) {
@@ -435,6 +676,13 @@ MSI_FILE *msi_file_new(char *buffer, uint32_t len)
 		msi_file_free(msi);
 		return NULL; /* FAILED */
 	}
+	/* build one-time lookup tables; on failure fall back to per-call chain walks */
+	if (!load_fat_chain(msi)) {
+		printf("Warning: Failed to build a FAT lookup table\n");
+	}
+	if (!load_directory_chain(msi)) {
+		printf("Warning: Failed to build a directory sector table\n");
+	}
 	root = msi_root_entry_get(msi);
 	if (!root) {
 		printf("Failed to get msi root entry\n");
@@ -442,23 +690,19 @@ MSI_FILE *msi_file_new(char *buffer, uint32_t len)
 		return NULL; /* FAILED */
 	}
 	msi->m_miniStreamStartSector = root->startSectorLocation;
-	OPENSSL_free(root);
 	return msi;
 }
 
-/* Recursively create a tree of MSI_DIRENT structures */
-int msi_dirent_new(MSI_FILE *msi, MSI_ENTRY *entry, MSI_DIRENT *parent, MSI_DIRENT **ret)
+/* Create a single MSI_DIRENT node and link it to its parent */
+static MSI_DIRENT *msi_dirent_add(MSI_FILE *msi, MSI_ENTRY *entry, MSI_DIRENT *parent, MSI_DIRENT **ret)
 {
 	MSI_DIRENT *dirent;
 	static int cnt;
 	static MSI_DIRENT *tortoise, *hare;
 
-	if (!entry) {
-		return 1; /* OK */
-	}
 	if (entry->nameLen == 0 || entry->nameLen > 64) {
 		printf("Corrupted Directory Entry Name Length\n");
-		return 0; /* FAILED */
+		return NULL; /* FAILED */
 	}
 	/* detect cycles in previously visited entries (parents, siblings) */
 	if (!ret) { /* initialized (non-root entry) */
@@ -466,12 +710,11 @@ int msi_dirent_new(MSI_FILE *msi, MSI_ENTRY *entry, MSI_DIRENT *parent, MSI_DIRE
 				|| (entry->rightSiblingID != NOSTREAM && tortoise->entry->rightSiblingID == entry->rightSiblingID)
 				|| (entry->childID != NOSTREAM && tortoise->entry->childID == entry->childID)) {
 			printf("MSI_ENTRY cycle detected at level %d\n", cnt);
-			OPENSSL_free(entry);
-			return 0; /* FAILED */
+			return NULL; /* FAILED */
 		}
 	}
 
-	dirent = (MSI_DIRENT *)OPENSSL_malloc(sizeof(MSI_DIRENT));
+	dirent = (MSI_DIRENT *)arena_alloc(&msi->m_arena, sizeof(MSI_DIRENT));
 	memcpy(dirent->name, entry->name, entry->nameLen);
 	dirent->nameLen = entry->nameLen;
 	dirent->type = entry->type;
@@ -481,7 +724,7 @@ int msi_dirent_new(MSI_FILE *msi, MSI_ENTRY *entry, MSI_DIRENT *parent, MSI_DIRE
 
 	/* Floyd's cycle-finding algorithm */
 	if (!ret) { /* initialized (non-root entry) */
-		if (cnt++ & 1) /* move the tortoise every other invocation of msi_dirent_new() */
+		if (cnt++ & 1) /* move the tortoise every other invocation of msi_dirent_add() */
 			tortoise = tortoise->next;
 		hare->next = dirent; /* build a linked list of visited entries */
 		hare = dirent; /* move the hare every time */
@@ -493,42 +736,81 @@ int msi_dirent_new(MSI_FILE *msi, MSI_ENTRY *entry, MSI_DIRENT *parent, MSI_DIRE
 
 	if (parent && !sk_MSI_DIRENT_push(parent->children, dirent)) {
 		printf("Failed to insert MSI_DIRENT\n");
-		return 0; /* FAILED */
+		return NULL; /* FAILED */
 	}
 
 	if (ret)
 		*ret = dirent;
 
-	if (!recurse_entry(msi, entry->leftSiblingID, parent)
-			|| !recurse_entry(msi, entry->rightSiblingID, parent)
-			|| !recurse_entry(msi, entry->childID, dirent)) {
-		printf("Failed to add a sibling or a child to the tree\n");
-		return 0; /* FAILED */
-	}
-
-	return 1; /* OK */
+	return dirent; /* OK */
 }
 
-/* Add a sibling or a child to the tree */
-/* NOTE: These links are a tree, not a linked list */
-static int recurse_entry(MSI_FILE *msi, uint32_t entryID, MSI_DIRENT *parent)
+/* A pending sibling or child link for the traversal in msi_dirent_new() */
+typedef struct {
+	uint32_t entryID;
+	MSI_DIRENT *parent;
+} DIRENT_TASK;
+
+/*
+ * Create a tree of MSI_DIRENT structures.
+ * The sibling and child links are followed iteratively with an explicit
+ * stack, pushed in reverse, so the entries are visited in the same order
+ * as the former recursion and the tree can be arbitrarily deep.
+ * NOTE: These links are a tree, not a linked list.
+ */
+int msi_dirent_new(MSI_FILE *msi, MSI_ENTRY *entry, MSI_DIRENT *parent, MSI_DIRENT **ret)
 {
-	MSI_ENTRY *node;
+	MSI_DIRENT *dirent;
+	DIRENT_TASK *stack;
+	uint32_t depth = 0, alloc = 64;
 
-	/* The special NOSTREAM (0xFFFFFFFF) value is used as a terminator */
-	if (entryID == NOSTREAM) /* stop condition */
+	if (!entry) {
 		return 1; /* OK */
-
-	node = get_entry(msi, entryID, FALSE);
-	if (!node) {
-		printf("Corrupted ID: 0x%08X\n", entryID);
-		return 0; /* FAILED */
 	}
-
-	if (!msi_dirent_new(msi, node, parent, NULL)) {
+	dirent = msi_dirent_add(msi, entry, parent, ret);
+	if (!dirent) {
 		return 0; /* FAILED */
 	}
+	stack = OPENSSL_malloc(alloc * sizeof(DIRENT_TASK));
+	stack[depth].entryID = entry->childID;
+	stack[depth++].parent = dirent;
+	stack[depth].entryID = entry->rightSiblingID;
+	stack[depth++].parent = parent;
+	stack[depth].entryID = entry->leftSiblingID;
+	stack[depth++].parent = parent;
+
+	while (depth > 0) {
+		DIRENT_TASK task = stack[--depth];
+		MSI_ENTRY *node;
+
+		/* The special NOSTREAM (0xFFFFFFFF) value is used as a terminator */
+		if (task.entryID == NOSTREAM) /* stop condition */
+			continue;
 
+		node = get_entry(msi, task.entryID, FALSE);
+		if (!node) {
+			printf("Corrupted ID: 0x%08X\n", task.entryID);
+			OPENSSL_free(stack);
+			return 0; /* FAILED */
+		}
+		dirent = msi_dirent_add(msi, node, task.parent, NULL);
+		if (!dirent) {
+			printf("Failed to add a sibling or a child to the tree\n");
+			OPENSSL_free(stack);
+			return 0; /* FAILED */
+		}
+		if (depth + 3 > alloc) {
+			alloc *= 2;
+			stack = OPENSSL_realloc(stack, alloc * sizeof(DIRENT_TASK));
+		}
+		stack[depth].entryID = node->childID;
+		stack[depth++].parent = dirent;
+		stack[depth].entryID = node->rightSiblingID;
+		stack[depth++].parent = task.parent;
+		stack[depth].entryID = node->leftSiblingID;
+		stack[depth++].parent = task.parent;
+	}
+	OPENSSL_free(stack);
 	return 1; /* OK */
 }
 
@@ -555,6 +837,11 @@ void msi_file_free(MSI_FILE *msi)
 {
 	if (!msi)
 		return;
+	OPENSSL_free(msi->m_fatChain);
+	OPENSSL_free(msi->m_minifatChain);
+	OPENSSL_free(msi->m_ministreamChain);
+	OPENSSL_free(msi->m_dirSectors);
+	arena_free(msi->m_arena);
 	OPENSSL_free(msi->m_hdr);
 	OPENSSL_free(msi);
 }
@@ -564,9 +851,9 @@ void msi_dirent_free(MSI_DIRENT *dirent)
 {
 	if (!dirent)
 		return;
+	/* the nodes themselves are reclaimed with the MSI_FILE arena */
 	sk_MSI_DIRENT_pop_free(dirent->children, msi_dirent_free);
-	OPENSSL_free(dirent->entry);
-	OPENSSL_free(dirent);
+	dirent->children = NULL;
 }
 
 /* Sorted list of MSI streams in this order is needed for hashing */
@@ -664,9 +951,188 @@ out:
 	return ret;
 }
 
+/*
+ * Iterate a stream's sector chain as (pointer, length) runs inside
+ * msi->m_buffer, coalescing physically contiguous sectors, so stream data
+ * can be hashed or copied without a heap copy of the whole stream.
+ */
+typedef int (*MSI_RUN_CB)(void *arg, const u_char *data, uint32_t len);
+
+static int stream_runs(MSI_FILE *msi, MSI_ENTRY *entry, uint32_t inlen, MSI_RUN_CB cb, void *arg)
+{
+	int mini = inlen < msi->m_hdr->miniStreamCutoffSize;
+	uint32_t sectorSize = mini ? msi->m_minisectorSize : msi->m_sectorSize;
+	uint32_t sector = entry->startSectorLocation;
+	const u_char *run = NULL;
+	uint32_t runLen = 0;
+
+	while (inlen > 0) {
+		const u_char *address;
+		uint32_t copylen;
+		address = mini ? mini_sector_offset_to_address(msi, sector, 0)
+			: sector_offset_to_address(msi, sector, 0);
+		if (!address) {
+			printf("Failed to get a next sector address\n");
+			return 0; /* FAILED */
+		}
+		copylen = MIN(inlen, sectorSize);
+		if (msi->m_buffer + msi->m_bufferLen < address + copylen) {
+			printf("Corrupted file\n");
+			return 0; /* FAILED */
+		}
+		if (run && address == run + runLen) {
+			/* extend the current run */
+			runLen += copylen;
+		} else {
+			if (run && !cb(arg, run, runLen)) {
+				return 0; /* FAILED */
+			}
+			run = address;
+			runLen = copylen;
+		}
+		inlen -= copylen;
+		if (inlen > 0) {
+			sector = mini ? get_next_mini_sector(msi, sector) : get_next_sector(msi, sector);
+			if (sector == NOSTREAM || sector == ENDOFCHAIN) {
+				printf("Failed to get a next sector\n");
+				return 0; /* FAILED */
+			}
+		}
+	}
+	if (run && !cb(arg, run, runLen)) {
+		return 0; /* FAILED */
+	}
+	return 1; /* OK */
+}
+
+/* Feed a run to a BIO, either a hash chain or the output file */
+static int bio_write_run(void *arg, const u_char *data, uint32_t len)
+{
+	return BIO_write((BIO *)arg, data, (int)len) == (int)len;
+}
+
+/* Hash a stream directly from the mapped file */
+static int hash_stream(MSI_FILE *msi, MSI_ENTRY *entry, BIO *hash, uint32_t inlen)
+{
+	return stream_runs(msi, entry, inlen, bio_write_run, hash);
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Read-ahead pipeline for msi_hash_dir().  A worker thread walks the
+ * streams in hash order a bounded number of streams ahead of the consumer,
+ * resolving their sector chains and touching one byte per page, so page
+ * faults on a cold or network-backed mapping overlap with hashing while
+ * the hash itself is still fed strictly in the deterministic order.
+ */
+#define MSI_PREFETCH_AHEAD 8
+
+typedef struct {
+	MSI_FILE *msi;
+	MSI_ENTRY **streams;   /* stream entries in hash order */
+	int count;
+	int hashed;            /* consumer progress */
+	int stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} MSI_PREFETCH;
+
+static MSI_PREFETCH msi_prefetch; /* active while msi_hash_dir() runs */
+
+/* Collect the stream entries in the order msi_hash_dir() will hash them */
+static int collect_streams(MSI_DIRENT *dirent, int is_root, MSI_ENTRY ***streams,
+			int *count, int *alloc)
+{
+	int i, ret = 0;
+	STACK_OF(MSI_DIRENT) *children = sk_MSI_DIRENT_dup(dirent->children);
+
+	sk_MSI_DIRENT_set_cmp_func(children, &dirent_cmp_hash);
+	sk_MSI_DIRENT_sort(children);
+	for (i = 0; i < sk_MSI_DIRENT_num(children); i++) {
+		MSI_DIRENT *child = sk_MSI_DIRENT_value(children, i);
+		if (is_root && (!memcmp(child->name, digital_signature, MIN(child->nameLen, sizeof digital_signature))
+				|| !memcmp(child->name, digital_signature_ex, MIN(child->nameLen, sizeof digital_signature_ex)))) {
+			continue;
+		}
+		if (child->type == DIR_STREAM && GET_UINT32_LE(child->entry->size) > 0) {
+			if (*count >= *alloc) {
+				*alloc *= 2;
+				*streams = OPENSSL_realloc(*streams, (size_t)*alloc * sizeof(MSI_ENTRY *));
+			}
+			(*streams)[(*count)++] = child->entry;
+		}
+		if (child->type == DIR_STORAGE) {
+			if (!collect_streams(child, 0, streams, count, alloc)) {
+				goto out;
+			}
+		}
+	}
+	ret = 1; /* OK */
+out:
+	sk_MSI_DIRENT_free(children);
+	return ret;
+}
+
+/*
+ * Start readahead for one coalesced extent of a stream.  MADV_WILLNEED
+ * queues asynchronous readahead, so on a cold cache the extents of the
+ * next streams are already in flight while the current one is hashed.
+ * Without madvise() the pages are faulted in by touching one byte each,
+ * which at least overlaps the I/O wait with the hashing thread.
+ */
+static int willneed_run(void *arg, const u_char *data, uint32_t len)
+{
+	MSI_FILE *msi = arg;
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_WILLNEED)
+	size_t pagemask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+	size_t begin = (size_t)(data - msi->m_buffer) & ~pagemask;
+	size_t end = ((size_t)(data - msi->m_buffer) + len + pagemask) & ~pagemask;
+
+	madvise((void *)(msi->m_buffer + begin), end - begin, MADV_WILLNEED);
+#else
+	volatile u_char sink = 0;
+	uint32_t i;
+
+	(void)msi;
+	for (i = 0; i < len; i += 4096)
+		sink ^= data[i];
+	(void)sink;
+#endif /* HAVE_SYS_MMAN_H && MADV_WILLNEED */
+	return 1; /* OK */
+}
+
+/* Request readahead of a stream's extent list before the hashing pass */
+static void prefetch_stream(MSI_FILE *msi, MSI_ENTRY *entry)
+{
+	uint32_t inlen = GET_UINT32_LE(entry->size);
+
+	stream_runs(msi, entry, inlen, willneed_run, msi);
+}
+
+static void *prefetch_worker(void *arg)
+{
+	MSI_PREFETCH *pf = arg;
+	int i, stop;
+
+	for (i = 0; i < pf->count; i++) {
+		pthread_mutex_lock(&pf->mutex);
+		while (!pf->stop && i >= pf->hashed + MSI_PREFETCH_AHEAD) {
+			pthread_cond_wait(&pf->cond, &pf->mutex);
+		}
+		stop = pf->stop;
+		pthread_mutex_unlock(&pf->mutex);
+		if (stop) {
+			break;
+		}
+		prefetch_stream(pf->msi, pf->streams[i]);
+	}
+	return NULL;
+}
+#endif /* HAVE_PTHREAD_H */
+
 /* Recursively hash a MSI directory (storage) */
-int msi_hash_dir(MSI_FILE *msi, MSI_DIRENT *dirent, BIO *hash, int is_root)
- {
+static int msi_hash_dir_rec(MSI_FILE *msi, MSI_DIRENT *dirent, BIO *hash, int is_root)
+{
 	int i, ret = 0;
 
 	STACK_OF(MSI_DIRENT) *children = sk_MSI_DIRENT_dup(dirent->children);
@@ -680,22 +1146,26 @@ int msi_hash_dir(MSI_FILE *msi, MSI_DIRENT *dirent, BIO *hash, int is_root)
 			continue;
 		}
 		if (child->type == DIR_STREAM) {
-			char *indata;
 			uint32_t inlen = GET_UINT32_LE(child->entry->size);
 			if (inlen == 0) {
 				continue;
 			}
-			indata = (char *)OPENSSL_malloc(inlen);
-			if (!msi_file_read(msi, child->entry, 0, indata, inlen)) {
-				printf("Failed to read stream data\n");
-				OPENSSL_free(indata);
+			if (!hash_stream(msi, child->entry, hash, inlen)) {
+				printf("Failed to hash stream data\n");
 				goto out;
 			}
-			BIO_write(hash, indata, (int)inlen);
-			OPENSSL_free(indata);
+#ifdef HAVE_PTHREAD_H
+			if (msi_prefetch.streams) {
+				/* open the read-ahead window for the worker */
+				pthread_mutex_lock(&msi_prefetch.mutex);
+				msi_prefetch.hashed++;
+				pthread_cond_broadcast(&msi_prefetch.cond);
+				pthread_mutex_unlock(&msi_prefetch.mutex);
+			}
+#endif /* HAVE_PTHREAD_H */
 		}
 		if (child->type == DIR_STORAGE) {
-			if (!msi_hash_dir(msi, child, hash, 0)) {
+			if (!msi_hash_dir_rec(msi, child, hash, 0)) {
 				printf("Failed to hash a MSI storage\n");
 				goto out;
 			}
@@ -708,6 +1178,149 @@ out:
 	return ret;
 }
 
+/* Hash a MSI directory tree, prefetching the streams ahead of the consumer */
+int msi_hash_dir(MSI_FILE *msi, MSI_DIRENT *dirent, BIO *hash, int is_root)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_t thread;
+	int started = 0, ret;
+
+	if (is_root && !msi_prefetch.streams) {
+		int alloc = 64;
+
+		msi_prefetch.count = 0;
+		msi_prefetch.streams = OPENSSL_malloc((size_t)alloc * sizeof(MSI_ENTRY *));
+		if (!collect_streams(dirent, is_root, &msi_prefetch.streams,
+				&msi_prefetch.count, &alloc) || msi_prefetch.count < 2) {
+			OPENSSL_free(msi_prefetch.streams);
+			msi_prefetch.streams = NULL;
+		} else {
+			/* the lazy mini chain build must not race the worker */
+			ensure_mini_chains(msi);
+			msi_prefetch.msi = msi;
+			msi_prefetch.hashed = 0;
+			msi_prefetch.stop = 0;
+			pthread_mutex_init(&msi_prefetch.mutex, NULL);
+			pthread_cond_init(&msi_prefetch.cond, NULL);
+			started = !pthread_create(&thread, NULL, prefetch_worker, &msi_prefetch);
+			if (!started) {
+				pthread_mutex_destroy(&msi_prefetch.mutex);
+				pthread_cond_destroy(&msi_prefetch.cond);
+				OPENSSL_free(msi_prefetch.streams);
+				msi_prefetch.streams = NULL;
+			}
+		}
+	}
+	ret = msi_hash_dir_rec(msi, dirent, hash, is_root);
+	if (started) {
+		pthread_mutex_lock(&msi_prefetch.mutex);
+		msi_prefetch.stop = 1;
+		pthread_cond_broadcast(&msi_prefetch.cond);
+		pthread_mutex_unlock(&msi_prefetch.mutex);
+		pthread_join(thread, NULL);
+		pthread_mutex_destroy(&msi_prefetch.mutex);
+		pthread_cond_destroy(&msi_prefetch.cond);
+		OPENSSL_free(msi_prefetch.streams);
+		msi_prefetch.streams = NULL;
+	}
+	return ret;
+#else
+	return msi_hash_dir_rec(msi, dirent, hash, is_root);
+#endif /* HAVE_PTHREAD_H */
+}
+
+/*
+ * Fast non-cryptographic fingerprint of the directory tree: the
+ * metadata covered by the pre-hash and the stream contents in the
+ * deterministic hash order, skipping the signature streams the same
+ * way as the hashing passes.  The checksum runs at memory bandwidth,
+ * an order of magnitude faster than the Authenticode digest, which
+ * makes it cheap enough to decide whether a rebuilt container still
+ * has the digests of a previous signing pass.
+ */
+static uint64_t checksum_mix(uint64_t sum, const u_char *data, size_t len)
+{
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy(&word, data, 8);
+		sum = (sum ^ word) * UINT64_C(0x9e3779b97f4a7c15);
+		sum ^= sum >> 29;
+		data += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		sum = (sum ^ *data) * UINT64_C(0x100000001b3);
+		data++;
+		len--;
+	}
+	return sum;
+}
+
+static int checksum_run(void *arg, const u_char *data, uint32_t len)
+{
+	uint64_t *sum = arg;
+
+	*sum = checksum_mix(*sum, data, len);
+	return 1; /* OK */
+}
+
+/* Mix the metadata fields covered by prehash_metadata() */
+static void checksum_metadata(uint64_t *sum, MSI_ENTRY *entry)
+{
+	*sum = checksum_mix(*sum, entry->name, entry->nameLen);
+	*sum = checksum_mix(*sum, entry->size, sizeof entry->size);
+	*sum = checksum_mix(*sum, entry->clsid, sizeof entry->clsid);
+	*sum = checksum_mix(*sum, entry->stateBits, sizeof entry->stateBits);
+	*sum = checksum_mix(*sum, entry->creationTime, sizeof entry->creationTime);
+	*sum = checksum_mix(*sum, entry->modifiedTime, sizeof entry->modifiedTime);
+}
+
+static int content_checksum_rec(MSI_FILE *msi, MSI_DIRENT *dirent, uint64_t *sum, int is_root)
+{
+	int i, ret = 0;
+	STACK_OF(MSI_DIRENT) *children = sk_MSI_DIRENT_dup(dirent->children);
+
+	checksum_metadata(sum, dirent->entry);
+	sk_MSI_DIRENT_set_cmp_func(children, &dirent_cmp_hash);
+	sk_MSI_DIRENT_sort(children);
+	for (i = 0; i < sk_MSI_DIRENT_num(children); i++) {
+		MSI_DIRENT *child = sk_MSI_DIRENT_value(children, i);
+		if (is_root && (!memcmp(child->name, digital_signature, MIN(child->nameLen, sizeof digital_signature))
+				|| !memcmp(child->name, digital_signature_ex, MIN(child->nameLen, sizeof digital_signature_ex)))) {
+			continue;
+		}
+		if (child->type == DIR_STREAM) {
+			uint32_t inlen = GET_UINT32_LE(child->entry->size);
+
+			checksum_metadata(sum, child->entry);
+			if (inlen != 0 && !stream_runs(msi, child->entry, inlen, checksum_run, sum)) {
+				goto out;
+			}
+		}
+		if (child->type == DIR_STORAGE) {
+			if (!content_checksum_rec(msi, child, sum, 0)) {
+				goto out;
+			}
+		}
+	}
+	ret = 1; /* OK */
+out:
+	sk_MSI_DIRENT_free(children);
+	return ret;
+}
+
+int msi_content_checksum(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *sum)
+{
+	uint64_t csum = UINT64_C(0xcbf29ce484222325);
+
+	if (!content_checksum_rec(msi, dirent, &csum, 1))
+		return 0; /* FAILED */
+	PUT_UINT32_LE((uint32_t)csum, sum);
+	PUT_UINT32_LE((uint32_t)(csum >> 32), sum + 4);
+	return 1; /* OK */
+}
+
 /* Compute a simple sha1/sha256 message digest of the MSI file */
 int msi_calc_digest(char *indata, int mdtype, u_char *mdbuf, uint32_t fileend)
 {
@@ -776,6 +1389,16 @@ static void fat_append(MSI_OUT *out, char *buf, uint32_t len)
 	out->fatLen += len;
 }
 
+static void dirtree_append(MSI_OUT *out, char *buf, uint32_t len)
+{
+	if (out->dirtreeLen == (uint64_t)out->dirtreeMemallocCount * out->sectorSize) {
+		out->dirtreeMemallocCount += 1;
+		out->dirtree = OPENSSL_realloc(out->dirtree, (size_t)(out->dirtreeMemallocCount * out->sectorSize));
+	}
+	memcpy(out->dirtree + out->dirtreeLen, buf, (size_t)len);
+	out->dirtreeLen += len;
+}
+
 int msi_dirent_delete(MSI_DIRENT *dirent, const u_char *name, uint16_t nameLen)
 {
 	int i;
@@ -795,10 +1418,10 @@ int msi_dirent_delete(MSI_DIRENT *dirent, const u_char *name, uint16_t nameLen)
 	return 1; /* OK */
 }
 
-static MSI_DIRENT *dirent_add(const u_char *name, uint16_t nameLen)
+static MSI_DIRENT *dirent_add(MSI_FILE *msi, const u_char *name, uint16_t nameLen)
 {
-	MSI_DIRENT *dirent = (MSI_DIRENT *)OPENSSL_malloc(sizeof(MSI_DIRENT));
-	MSI_ENTRY *entry = (MSI_ENTRY *)OPENSSL_malloc(sizeof(MSI_ENTRY));
+	MSI_DIRENT *dirent = (MSI_DIRENT *)arena_alloc(&msi->m_arena, sizeof(MSI_DIRENT));
+	MSI_ENTRY *entry = (MSI_ENTRY *)arena_alloc(&msi->m_arena, sizeof(MSI_ENTRY));
 
 	memcpy(dirent->name, name, nameLen);
 	dirent->nameLen = nameLen;
@@ -823,7 +1446,7 @@ static MSI_DIRENT *dirent_add(const u_char *name, uint16_t nameLen)
 	return dirent;
 }
 
-static int dirent_insert(MSI_DIRENT *dirent, const u_char *name, uint16_t nameLen)
+static int dirent_insert(MSI_FILE *msi, MSI_DIRENT *dirent, const u_char *name, uint16_t nameLen)
 {
 	MSI_DIRENT *new_dirent;
 
@@ -831,16 +1454,16 @@ static int dirent_insert(MSI_DIRENT *dirent, const u_char *name, uint16_t nameLe
 		return 0; /* FAILED */
 	}
 	/* create new dirent */
-	new_dirent = dirent_add(name, nameLen);
+	new_dirent = dirent_add(msi, name, nameLen);
 	sk_MSI_DIRENT_push(dirent->children, new_dirent);
 
 	return 1; /* OK */
 }
 
-static int signature_insert(MSI_DIRENT *dirent, uint32_t len_msiex)
+static int signature_insert(MSI_FILE *msi, MSI_DIRENT *dirent, uint32_t len_msiex)
 {
 	if (len_msiex > 0) {
-		if (!dirent_insert(dirent, digital_signature_ex, sizeof digital_signature_ex)) {
+		if (!dirent_insert(msi, dirent, digital_signature_ex, sizeof digital_signature_ex)) {
 			return 0; /* FAILED */
 		}
 	} else {
@@ -848,28 +1471,17 @@ static int signature_insert(MSI_DIRENT *dirent, uint32_t len_msiex)
 			return 0; /* FAILED */
 		}
 	}
-	if (!dirent_insert(dirent, digital_signature, sizeof digital_signature)) {
+	if (!dirent_insert(msi, dirent, digital_signature, sizeof digital_signature)) {
 			return 0; /* FAILED */
 	}
 	return 1; /* OK */
 }
 
-static uint32_t stream_read(MSI_FILE *msi, MSI_ENTRY *entry, u_char *p_msi, uint32_t len_msi,
-		u_char *p_msiex, uint32_t len_msiex, char **indata, uint32_t inlen, int is_root)
+/* Append a run of stream data to the new mini stream */
+static int ministream_run(void *arg, const u_char *data, uint32_t len)
 {
-	if (is_root && !memcmp(entry->name, digital_signature, sizeof digital_signature)) {
-		*indata = (char *)p_msi;
-		inlen = len_msi;
-	} else if (is_root && !memcmp(entry->name, digital_signature_ex, sizeof digital_signature_ex)) {
-		*indata = (char *)p_msiex;
-		inlen = len_msiex;
-	} else {
-		if (!msi_file_read(msi, entry, 0, *indata, inlen)) {
-			printf("Failed to read stream data\n");
-			return 0; /* FAILED */
-		}
-	}
-	return inlen;
+	ministream_append((MSI_OUT *)arg, (char *)data, len);
+	return 1; /* OK */
 }
 
 /* Recursively handle data from MSI_DIRENT struct */
@@ -879,7 +1491,7 @@ static int stream_handle(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *p_msi, uint3
 	int i;
 
 	if (dirent->type == DIR_ROOT) {
-		if (len_msi > 0 && !signature_insert(dirent, len_msiex)) {
+		if (len_msi > 0 && !signature_insert(msi, dirent, len_msiex)) {
 			printf("Insert new signature failed\n");
 			return 0; /* FAILED */
 		}
@@ -894,21 +1506,33 @@ static int stream_handle(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *p_msi, uint3
 			}
 		} else { /* DIR_STREAM */
 			uint32_t inlen = GET_UINT32_LE(child->entry->size);
-			char *indata = (char *)OPENSSL_malloc(inlen);
+			const u_char *indata = NULL;
 			char buf[MAX_SECTOR_SIZE];
 
-			inlen = stream_read(msi, child->entry, p_msi, len_msi, p_msiex, len_msiex, &indata, inlen, is_root);
+			/* the signature streams are supplied by the caller */
+			if (is_root && !memcmp(child->entry->name, digital_signature, sizeof digital_signature)) {
+				indata = p_msi;
+				inlen = len_msi;
+			} else if (is_root && !memcmp(child->entry->name, digital_signature_ex, sizeof digital_signature_ex)) {
+				indata = p_msiex;
+				inlen = len_msiex;
+			}
 			if (inlen == 0) {
 				continue;
 			}
-			/* set the size of the user-defined data if this is a stream object */
-			PUT_UINT32_LE(inlen, buf);
-			memcpy(child->entry->size, buf, sizeof child->entry->size);
-
 			if (inlen < MINI_STREAM_CUTOFF_SIZE) {
+				/* copy the stream into the new mini stream, directly from the input map */
+				if (indata) {
+					ministream_append(out, (char *)indata, inlen);
+				} else if (!stream_runs(msi, child->entry, inlen, ministream_run, out)) {
+					printf("Failed to read stream data\n");
+					return 0; /* FAILED */
+				}
+				/* set the size of the user-defined data if this is a stream object */
+				PUT_UINT32_LE(inlen, buf);
+				memcpy(child->entry->size, buf, sizeof child->entry->size);
 				/* set the index into the mini FAT to track the chain of sectors through the mini stream */
 				child->entry->startSectorLocation = out->miniSectorNum;
-				ministream_append(out, indata, inlen);
 				/* fill to the end with known data, such as all zeroes */
 				if (inlen % msi->m_minisectorSize > 0) {
 					uint32_t remain = msi->m_minisectorSize - inlen % msi->m_minisectorSize;
@@ -925,10 +1549,18 @@ static int stream_handle(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *p_msi, uint3
 				minifat_append(out, buf, 4);
 				out->miniSectorNum += 1;
 			} else {
+				/* stream save, directly from the input map */
+				if (indata) {
+					BIO_write(outdata, indata, (int)inlen);
+				} else if (!stream_runs(msi, child->entry, inlen, bio_write_run, outdata)) {
+					printf("Failed to read stream data\n");
+					return 0; /* FAILED */
+				}
+				/* set the size of the user-defined data if this is a stream object */
+				PUT_UINT32_LE(inlen, buf);
+				memcpy(child->entry->size, buf, sizeof child->entry->size);
 				/* set the first sector location if this is a stream object */
 				child->entry->startSectorLocation = out->sectorNum;
-				/* stream save */
-				BIO_write(outdata, indata, (int)inlen);
 				/* fill to the end with known data, such as all zeroes */
 				if (inlen % out->sectorSize > 0) {
 					uint32_t remain = out->sectorSize - inlen % out->sectorSize;
@@ -946,7 +1578,6 @@ static int stream_handle(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *p_msi, uint3
 				fat_append(out, buf, 4);
 				out->sectorNum += 1;
 			}
-			OPENSSL_free(indata);
 		}
 	}
 	return 1; /* OK */
@@ -955,20 +1586,22 @@ static int stream_handle(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *p_msi, uint3
 static void ministream_save(MSI_DIRENT *dirent, BIO *outdata, MSI_OUT *out)
 {
 	char buf[MAX_SECTOR_SIZE];
-	uint32_t i, remain;
+	uint32_t i, remain, writeLen;
 	uint32_t ministreamSectorsCount = (out->miniStreamLen + out->sectorSize - 1) / out->sectorSize;
 
 	/* set the first sector of the mini stream in the entry root object */
 	dirent->entry->startSectorLocation = out->sectorNum;
+	/* fill to the end with known data, such as all zeroes; the buffer is
+	 * allocated in whole sectors, so the padding fits behind the data */
+	writeLen = out->miniStreamLen;
+	if (writeLen % out->sectorSize > 0) {
+		remain = out->sectorSize - writeLen % out->sectorSize;
+		memset(out->ministream + writeLen, 0, (size_t)remain);
+		writeLen += remain;
+	}
 	/* ministream save */
-	BIO_write(outdata, out->ministream, (int)out->miniStreamLen);
+	BIO_write(outdata, out->ministream, (int)writeLen);
 	OPENSSL_free(out->ministream);
-	/* fill to the end with known data, such as all zeroes */
-	if (out->miniStreamLen % out->sectorSize > 0) {
-		remain = out->sectorSize - out->miniStreamLen % out->sectorSize;
-		memset(buf, 0, (size_t)remain);
-		BIO_write(outdata, buf, (int)remain);
-	}
 	/* set a sector chain in the FAT */
 	for (i=1; i<ministreamSectorsCount; i++) {
 		PUT_UINT32_LE(out->sectorNum + i, buf);
@@ -994,18 +1627,17 @@ static void minifat_save(BIO *outdata, MSI_OUT *out)
 	}
 	PUT_UINT32_LE(out->sectorNum, buf);
 	memcpy(out->header + HEADER_MINI_FAT_SECTOR_LOC, buf, 4);
-	/* minifat save */
-	BIO_write(outdata, out->minifat, (int)out->minifatLen);
 	/* marks the end of the stream */
 	PUT_UINT32_LE(ENDOFCHAIN, buf);
-	BIO_write(outdata, buf, 4);
-	out->minifatLen += 4;
+	minifat_append(out, buf, 4);
 	/* empty unallocated free sectors in the last Mini FAT sector */
 	if (out->minifatLen % out->sectorSize > 0) {
 		remain = out->sectorSize - out->minifatLen % out->sectorSize;
 		memset(buf, (int)FREESECT, (size_t)remain);
-		BIO_write(outdata, buf, (int)remain);
+		minifat_append(out, buf, remain);
 	}
+	/* minifat save */
+	BIO_write(outdata, out->minifat, (int)out->minifatLen);
 	/* set a sector chain in the FAT */
 	out->minifatSectorsCount = (out->minifatLen + out->sectorSize - 1) / out->sectorSize;
 	for (i=1; i<out->minifatSectorsCount; i++) {
@@ -1019,10 +1651,9 @@ static void minifat_save(BIO *outdata, MSI_OUT *out)
 	out->sectorNum += out->minifatSectorsCount;
 }
 
-static char *msi_dirent_get(MSI_ENTRY *entry)
+static void msi_dirent_get(MSI_ENTRY *entry, char *data)
 {
 	char buf[8];
-	char *data = OPENSSL_malloc(DIRENT_SIZE);
 
 	/* initialise 128 bytes */
 	memset(data, 0, DIRENT_SIZE);
@@ -1049,26 +1680,22 @@ static char *msi_dirent_get(MSI_ENTRY *entry)
 	memcpy(data + DIRENT_START_SECTOR_LOC, buf, 4);
 	memcpy(data + DIRENT_FILE_SIZE, entry->size, 4);
 	memset(data + DIRENT_FILE_SIZE + 4, 0, 4);
-	return data;
 }
 
-static char *msi_unused_dirent_get()
+static void msi_unused_dirent_get(char *data)
 {
-	char *data = OPENSSL_malloc(DIRENT_SIZE);
-
 	/* initialise 127 bytes */
 	memset(data, 0, DIRENT_SIZE);
 
 	memset(data + DIRENT_LEFT_SIBLING_ID, (int)NOSTREAM, 4);
 	memset(data + DIRENT_RIGHT_SIBLING_ID, (int)NOSTREAM, 4);
 	memset(data + DIRENT_CHILD_ID, (int)NOSTREAM, 4);
-	return data;
 }
 
-static int dirents_save(MSI_DIRENT *dirent, BIO *outdata, MSI_OUT *out, uint32_t *streamId, int count, int last)
+static int dirents_save(MSI_DIRENT *dirent, MSI_OUT *out, uint32_t *streamId, int count, int last)
 {
 	int i, childenNum;
-	char *entry;
+	char data[DIRENT_SIZE];
 	STACK_OF(MSI_DIRENT) *children = sk_MSI_DIRENT_dup(dirent->children);
 
 	sk_MSI_DIRENT_set_cmp_func(children, &dirent_cmp_tree);
@@ -1089,16 +1716,14 @@ static int dirents_save(MSI_DIRENT *dirent, BIO *outdata, MSI_OUT *out, uint32_t
 		dirent->entry->rightSiblingID = NOSTREAM;
 	}
 	dirent->entry->childID = *streamId + 1;
-	entry = msi_dirent_get(dirent->entry);
-	BIO_write(outdata, entry, DIRENT_SIZE);
-	OPENSSL_free(entry);
-	out->dirtreeLen += DIRENT_SIZE;
+	msi_dirent_get(dirent->entry, data);
+	dirtree_append(out, data, DIRENT_SIZE);
 	for (i = 0; i < childenNum; i++) {
 		MSI_DIRENT *child = sk_MSI_DIRENT_value(children, i);
 		int last_dir = i == childenNum - 1 ? 1 : 0;
 		*streamId += 1;
 		if (child->type == DIR_STORAGE) {
-			count += dirents_save(child, outdata, out, streamId, count, last_dir);
+			count += dirents_save(child, out, streamId, count, last_dir);
 		} else { /* DIR_STREAM */
 			count = 0;
 			child->entry->colorFlag = BLACK_COLOR;
@@ -1108,10 +1733,8 @@ static int dirents_save(MSI_DIRENT *dirent, BIO *outdata, MSI_OUT *out, uint32_t
 			} else {
 				child->entry->rightSiblingID = *streamId + 1;
 			}
-			entry = msi_dirent_get(child->entry);
-			BIO_write(outdata, entry, DIRENT_SIZE);
-			OPENSSL_free(entry);
-			out->dirtreeLen += DIRENT_SIZE;
+			msi_dirent_get(child->entry, data);
+			dirtree_append(out, data, DIRENT_SIZE);
 		}
 	}
 	sk_MSI_DIRENT_free(children);
@@ -1121,7 +1744,7 @@ static int dirents_save(MSI_DIRENT *dirent, BIO *outdata, MSI_OUT *out, uint32_t
 static void dirtree_save(MSI_DIRENT *dirent, BIO *outdata, MSI_OUT *out)
 {
 	char buf[MAX_SECTOR_SIZE];
-	char *unused_entry;
+	char unused_entry[DIRENT_SIZE];
 	uint32_t i, remain, streamId = 0;
 
 	/* set Directory Starting Sector Location in the header */
@@ -1133,20 +1756,21 @@ static void dirtree_save(MSI_DIRENT *dirent, BIO *outdata, MSI_OUT *out)
 		PUT_UINT32_LE(out->miniStreamLen, buf);
 		memcpy(dirent->entry->size, buf, sizeof dirent->entry->size);
 	}
-	/* sort and save all directory entries */
-	dirents_save(dirent, outdata, out, &streamId, 0, 0);
+	/* sort and collect all directory entries */
+	dirents_save(dirent, out, &streamId, 0, 0);
+	out->dirtreeSectorsCount = (out->dirtreeLen + out->sectorSize - 1) / out->sectorSize;
 	/* set free (unused) directory entries */
-	unused_entry = msi_unused_dirent_get();
+	msi_unused_dirent_get(unused_entry);
 	if (out->dirtreeLen % out->sectorSize > 0) {
 		remain = out->sectorSize - out->dirtreeLen % out->sectorSize;
 		while (remain > 0) {
-			BIO_write(outdata, unused_entry, DIRENT_SIZE);
+			dirtree_append(out, unused_entry, DIRENT_SIZE);
 			remain -= DIRENT_SIZE;
 		}
 	}
-	OPENSSL_free(unused_entry);
+	/* directory tree save */
+	BIO_write(outdata, out->dirtree, (int)out->dirtreeLen);
 	/* set a sector chain in the FAT */
-	out->dirtreeSectorsCount = (out->dirtreeLen + out->sectorSize - 1) / out->sectorSize;
 	for (i=1; i<out->dirtreeSectorsCount; i++) {
 		PUT_UINT32_LE(out->sectorNum + i, buf);
 		fat_append(out, buf, 4);
@@ -1332,6 +1956,7 @@ out:
 	OPENSSL_free(out.header);
 	OPENSSL_free(out.fat);
 	OPENSSL_free(out.minifat);
+	OPENSSL_free(out.dirtree);
 	return ret;
 }
 
@@ -105,6 +105,8 @@
 
 typedef unsigned char u_char;
 
+typedef struct msi_arena_block MSI_ARENA;
+
 typedef struct {
 	u_char signature[8];      /* 0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0xb1, 0x1a, 0xe1 */
 	u_char unused_clsid[16];  /* reserved and unused */
@@ -160,6 +162,16 @@ typedef struct {
 	uint32_t m_sectorSize;
 	uint32_t m_minisectorSize;
 	uint32_t m_miniStreamStartSector;
+	uint32_t *m_fatChain;          /* FAT lookup table: next sector for each sector */
+	uint32_t m_fatChainLen;
+	uint32_t *m_minifatChain;      /* mini FAT lookup table: next mini sector for each mini sector */
+	uint32_t m_minifatChainLen;
+	uint32_t *m_ministreamChain;   /* resolved sector chain of the mini stream */
+	uint32_t m_ministreamChainLen;
+	const u_char **m_dirSectors;   /* address of each directory chain sector */
+	uint32_t m_dirSectorCount;
+	int m_miniChainsLoaded;        /* the mini FAT tables are built on first use */
+	MSI_ARENA *m_arena;            /* pool for the directory metadata nodes */
 } MSI_FILE;
 
 typedef struct {
@@ -167,6 +179,7 @@ typedef struct {
 	char *ministream;
 	char *minifat;
 	char *fat;
+	char *dirtree;
 	uint32_t dirtreeLen;
 	uint32_t miniStreamLen;
 	uint32_t minifatLen;
@@ -174,6 +187,7 @@ typedef struct {
 	uint32_t ministreamsMemallocCount;
 	uint32_t minifatMemallocCount;
 	uint32_t fatMemallocCount;
+	uint32_t dirtreeMemallocCount;
 	uint32_t dirtreeSectorsCount;
 	uint32_t minifatSectorsCount;
 	uint32_t fatSectorsCount;
@@ -222,6 +236,7 @@ MSI_ENTRY *msi_signatures_get(MSI_DIRENT *dirent, MSI_ENTRY **dse);
 void msi_dirent_free(MSI_DIRENT *dirent);
 int msi_prehash_dir(MSI_DIRENT *dirent, BIO *hash, int is_root);
 int msi_hash_dir(MSI_FILE *msi, MSI_DIRENT *dirent, BIO *hash, int is_root);
+int msi_content_checksum(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *sum);
 int msi_calc_digest(char *indata, int mdtype, u_char *mdbuf, uint32_t fileend);
 int msi_dirent_delete(MSI_DIRENT *dirent, const u_char *name, uint16_t nameLen);
 int msi_file_write(MSI_FILE *msi, MSI_DIRENT *dirent, u_char *p, uint32_t len,
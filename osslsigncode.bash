@@ -14,7 +14,7 @@ _comp_cmd_osslsigncode()
     local commands command options timestamps rfc3161
 
     commands="--help --version -v
-        sign add attach-signature extract-signature remove-signature verify"
+        sign sign-batch daemon add attach-signature extract-signature remove-signature verify verify-batch"
 
     timestamps="http://timestamp.digicert.com
         http://time.certum.pl
@@ -36,7 +36,8 @@ _comp_cmd_osslsigncode()
         case $prev in
             -ac | -c | -catalog | -certs | -spc | -key | -pkcs12 | -pass | \
             -readpass | -pkcs11engine | -pkcs11module | -in | -out | -sigin | \
-            -n | -CAfile | -CRLfile  | -TSA-CAfile | -TSA-CRLfile)
+            -n | -CAfile | -CRLfile  | -TSA-CAfile | -TSA-CRLfile | \
+            -socket | -digest-cache)
                 _filedir
                 return
                 ;;
@@ -96,8 +96,16 @@
 #ifdef HAVE_TERMIOS_H
 #include <termios.h>
 #endif /* HAVE_TERMIOS_H */
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #endif /* _WIN32 */
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+
 #include <openssl/err.h>
 #include <openssl/objects.h>
 #include <openssl/evp.h>
@@ -199,6 +207,9 @@ typedef struct SIGNATURE_st {
 	CMS_ContentInfo *timestamp;
 	time_t time;
 	ASN1_STRING *blob;
+	PKCS7_SIGNER_INFO *si;
+	int allownest;
+	int decoded;
 } SIGNATURE;
 
 DEFINE_STACK_OF(SIGNATURE)
@@ -238,8 +249,10 @@ typedef struct {
 #endif /* ENABLE_CURL */
 	int addBlob;
 	int nest;
+	int inplace;
 	int ignore_timestamp;
 	int verbose;
+	int fast;
 	int add_msi_dse;
 	char *catalog;
 	char *cafile;
@@ -248,6 +261,13 @@ typedef struct {
 	char *tsa_crlfile;
 	char *leafhash;
 	int jp;
+	int threads;
+	char *socketpath;
+	char *digest_cache;
+	char *cachefile;
+	char *content_cachefile;
+	u_char cached_digest[EVP_MAX_MD_SIZE];
+	int cached_digest_len;
 } GLOBAL_OPTIONS;
 
 typedef struct {
@@ -277,6 +297,14 @@ typedef struct {
 	int len_msiex;
 } MSI_PARAMS;
 
+#define MAX_DIGEST_CACHE 8
+
+typedef struct {
+	int count;
+	int mdtype[MAX_DIGEST_CACHE];
+	u_char mdbuf[MAX_DIGEST_CACHE][EVP_MAX_MD_SIZE];
+} DIGEST_CACHE;
+
 /*
  * ASN.1 definitions (more or less from official MS Authenticode docs)
 */
@@ -765,9 +793,100 @@ static void print_hash(const char *descript1, const char *descript2, const u_cha
     printf("%s: %s %s\n", descript1, hexbuf, descript2);
 }
 
+/*
+ * OpenSSL 3 resolves EVP_get_digestbynid() and implicit digest
+ * initialization through the provider store, taking its lock each time.
+ * Fetch each algorithm explicitly once per process and hand out the
+ * cached implementation, so batch operations do not serialize on the
+ * store.  Older OpenSSL versions return static objects that need no
+ * caching.
+ */
+#define MAX_MD_CACHE 8
+
+static struct {
+	int nid;
+	EVP_MD *md;
+} md_cache[MAX_MD_CACHE];
+
+static const EVP_MD *md_by_nid(int nid)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MD *md;
+	int i;
+
+	for (i = 0; i < MAX_MD_CACHE && md_cache[i].nid; i++) {
+		if (md_cache[i].nid == nid)
+			return md_cache[i].md;
+	}
+	if (i < MAX_MD_CACHE) {
+		md = EVP_MD_fetch(NULL, OBJ_nid2sn(nid), NULL);
+		if (md) {
+			md_cache[i].md = md;
+			md_cache[i].nid = nid;
+			return md;
+		}
+	}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+	return EVP_get_digestbynid(nid);
+}
+
+/*
+ * Digest contexts are recycled through a small free list, so the hot
+ * hashing paths reset a context with EVP_DigestInit_ex() instead of
+ * allocating and freeing one around every computation.  The list is
+ * only used from the main thread; the page hash workers keep their
+ * own per-thread contexts.
+ */
+#define MAX_CTX_POOL 4
+
+static EVP_MD_CTX *ctx_pool[MAX_CTX_POOL];
+static int ctx_pool_len;
+
+static EVP_MD_CTX *md_ctx_get(const EVP_MD *md)
+{
+	EVP_MD_CTX *mdctx;
+
+	if (ctx_pool_len > 0)
+		mdctx = ctx_pool[--ctx_pool_len];
+	else
+		mdctx = EVP_MD_CTX_new();
+	if (!md || !mdctx || !EVP_DigestInit_ex(mdctx, md, NULL)) {
+		EVP_MD_CTX_free(mdctx);
+		return NULL; /* FAILED */
+	}
+	return mdctx;
+}
+
+static void md_ctx_put(EVP_MD_CTX *mdctx)
+{
+	if (!mdctx)
+		return;
+	if (ctx_pool_len < MAX_CTX_POOL)
+		ctx_pool[ctx_pool_len++] = mdctx;
+	else
+		EVP_MD_CTX_free(mdctx);
+}
+
+static void md_cache_cleanup(void)
+{
+	while (ctx_pool_len > 0)
+		EVP_MD_CTX_free(ctx_pool[--ctx_pool_len]);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	{
+		int i;
+
+		for (i = 0; i < MAX_MD_CACHE && md_cache[i].nid; i++) {
+			EVP_MD_free(md_cache[i].md);
+			md_cache[i].md = NULL;
+			md_cache[i].nid = 0;
+		}
+	}
+#endif /* OPENSSL_VERSION_NUMBER >= 0x30000000L */
+}
+
 static int compare_digests(u_char *mdbuf, u_char *cmdbuf, int mdtype)
 {
-	int mdlen = EVP_MD_size(EVP_get_digestbynid(mdtype));
+	int mdlen = EVP_MD_size(md_by_nid(mdtype));
 	int mdok = !memcmp(mdbuf, cmdbuf, (size_t)mdlen);
 	printf("Message digest algorithm  : %s\n", OBJ_nid2sn(mdtype));
 	print_hash("Current message digest    ", "", mdbuf, mdlen);
@@ -789,6 +908,120 @@ static int is_content_type(PKCS7 *p7, const char *objid)
 	return retval;
 }
 
+/*
+ * Multi-digest engine: several digest algorithms are computed in a single
+ * pass over the input data and the results are kept in a DIGEST_CACHE,
+ * so dual-signed (e.g. sha1 + sha256) files are read only once during
+ * verification.
+ */
+
+/* Return a digest computed with mdtype from the cache, or NULL */
+static u_char *digest_cache_get(DIGEST_CACHE *cache, int mdtype)
+{
+	int i;
+
+	for (i = 0; i < cache->count; i++) {
+		if (cache->mdtype[i] == mdtype)
+			return cache->mdbuf[i];
+	}
+	return NULL; /* not cached */
+}
+
+/* Store a computed digest in the cache, dropped when the cache is full */
+static void digest_cache_put(DIGEST_CACHE *cache, int mdtype, const u_char *mdbuf)
+{
+	if (cache->count >= MAX_DIGEST_CACHE || digest_cache_get(cache, mdtype))
+		return;
+	cache->mdtype[cache->count] = mdtype;
+	memcpy(cache->mdbuf[cache->count], mdbuf, EVP_MAX_MD_SIZE);
+	cache->count++;
+}
+
+/* Get the digest algorithm of a signature from its SpcIndirectDataContent */
+static int signature_get_mdtype(SIGNATURE *signature)
+{
+	int mdtype = -1;
+
+	if (is_content_type(signature->p7, SPC_INDIRECT_DATA_OBJID)) {
+		ASN1_STRING *content_val = signature->p7->d.sign->contents->d.other->value.sequence;
+		const u_char *p = content_val->data;
+		SpcIndirectDataContent *idc = d2i_SpcIndirectDataContent(NULL, &p, content_val->length);
+		if (idc) {
+			if (idc->messageDigest && idc->messageDigest->digest && idc->messageDigest->digestAlgorithm) {
+				mdtype = OBJ_obj2nid(idc->messageDigest->digestAlgorithm->algorithm);
+			}
+			SpcIndirectDataContent_free(idc);
+		}
+	}
+	return mdtype;
+}
+
+/* Collect the set of digest algorithms used across a signature stack */
+static int signatures_get_mdtypes(STACK_OF(SIGNATURE) *signatures, int *mdtypes)
+{
+	int i, j, count = 0;
+
+	for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
+		int mdtype = signature_get_mdtype(sk_SIGNATURE_value(signatures, i));
+		if (mdtype == -1)
+			continue;
+		for (j = 0; j < count; j++) {
+			if (mdtypes[j] == mdtype)
+				break;
+		}
+		if (j == count && count < MAX_DIGEST_CACHE)
+			mdtypes[count++] = mdtype;
+	}
+	return count;
+}
+
+/* Set up digest contexts for all requested algorithms */
+static int digests_init(EVP_MD_CTX **mdctx, const int *mdtypes, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		mdctx[i] = NULL;
+	for (i = 0; i < count; i++) {
+		mdctx[i] = md_ctx_get(md_by_nid(mdtypes[i]));
+		if (!mdctx[i]) {
+			printf("Unable to set up the digest context\n");
+			return 0; /* FAILED */
+		}
+	}
+	return 1; /* OK */
+}
+
+/* Update all digest contexts with the same data */
+static void digests_update(EVP_MD_CTX **mdctx, int count, const u_char *data, size_t len)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		EVP_DigestUpdate(mdctx[i], data, len);
+}
+
+/* Finalize all digest contexts into the cache */
+static void digests_final(EVP_MD_CTX **mdctx, const int *mdtypes, int count, DIGEST_CACHE *cache)
+{
+	u_char mdbuf[EVP_MAX_MD_SIZE];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		memset(mdbuf, 0, EVP_MAX_MD_SIZE);
+		EVP_DigestFinal(mdctx[i], mdbuf, NULL);
+		digest_cache_put(cache, mdtypes[i], mdbuf);
+	}
+}
+
+static void digests_free(EVP_MD_CTX **mdctx, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		md_ctx_put(mdctx[i]);
+}
+
 #ifdef ENABLE_CURL
 
 static int blob_has_nl = 0;
@@ -863,15 +1096,14 @@ static BIO *encode_rfc3161_request(PKCS7 *sig, const EVP_MD *md)
 	if (!si)
 		return NULL; /* FAILED */
 
-	mdctx = EVP_MD_CTX_new();
-	if (!EVP_DigestInit(mdctx, md)) {
-		EVP_MD_CTX_free(mdctx);
+	mdctx = md_ctx_get(md);
+	if (!mdctx) {
 		printf("Unable to set up the digest context\n");
 		return NULL;  /* FAILED */
 	}
 	EVP_DigestUpdate(mdctx, si->enc_digest->data, (size_t)si->enc_digest->length);
 	EVP_DigestFinal(mdctx, mdbuf, NULL);
-	EVP_MD_CTX_free(mdctx);
+	md_ctx_put(mdctx);
 
 	req = TimeStampReq_new();
 	ASN1_INTEGER_set(req->version, 1);
@@ -1053,24 +1285,18 @@ static CURLcode decode_authenticode_response(PKCS7 *sig, BIO *bin, int verbose)
 	return 0; /* OK */
 }
 
-/*
- * Add timestamp to the PKCS7 SignerInfo structure:
- * sig->d.sign->signer_info->unauth_attr
- */
-static int add_timestamp(PKCS7 *sig, char *url, char *proxy, int rfc3161,
-	const EVP_MD *md, int verbose, int noverifypeer)
+/* persistent timestamp client state: the easy handles and the multi handle
+ * live for the whole process, so batch and daemon mode reuse established
+ * TSA connections instead of paying DNS and TLS setup for every file */
+static CURLM *ts_multi;
+static CURL *ts_pool[MAX_TS_SERVERS];
+
+/* configure a (possibly reused) easy handle for one timestamp request */
+static struct curl_slist *ts_handle_setup(CURL *curl, char *url, char *proxy, int rfc3161,
+	int noverifypeer, char *postdata, long postlen, BIO *bin)
 {
-	CURL *curl;
 	struct curl_slist *slist = NULL;
-	CURLcode res;
-	BIO *bout, *bin;
-	u_char *p = NULL;
-	long len = 0;
 
-	if (!url)
-		return 1; /* FAILED */
-	/* Start a libcurl easy session and set options for a curl easy handle */
-	curl = curl_easy_init();
 	if (proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, proxy);
 		if (!strncmp("http:", proxy, 5))
@@ -1096,73 +1322,161 @@ static int add_timestamp(PKCS7 *sig, char *url, char *proxy, int rfc3161,
 	slist = curl_slist_append(slist, "User-Agent: Transport");
 	slist = curl_slist_append(slist, "Cache-Control: no-cache");
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, postlen);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
+	curl_easy_setopt(curl, CURLOPT_POST, 1);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, bin);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
+	return slist;
+}
 
-	/* Encode timestamp request */
-	if (rfc3161) {
+/* the request body and header list are freed after the transfer, the
+ * persistent handle must not keep dangling pointers to them */
+static void ts_handle_reset(CURL *curl, struct curl_slist *slist)
+{
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, 0L);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, NULL);
+	curl_slist_free_all(slist);
+}
+
+/*
+ * Add timestamp to the PKCS7 SignerInfo structure:
+ * sig->d.sign->signer_info->unauth_attr
+ * The request is issued to all configured TSA servers concurrently and
+ * the first valid response wins.
+ */
+static int add_timestamp(PKCS7 *sig, char **urls, int nurls, char *proxy, int rfc3161,
+	const EVP_MD *md, int verbose, int noverifypeer)
+{
+	struct curl_slist *slists[MAX_TS_SERVERS];
+	BIO *bins[MAX_TS_SERVERS];
+	int active[MAX_TS_SERVERS];
+	BIO *bout;
+	u_char *p = NULL;
+	long len = 0;
+	int i, nactive = 0, running, winner = -1;
+
+	if (nurls < 1)
+		return 1; /* FAILED */
+	if (!ts_multi)
+		ts_multi = curl_multi_init();
+	if (!ts_multi)
+		return 1; /* FAILED */
+
+	/* encode the timestamp request once for all servers */
+	if (rfc3161)
 		bout = encode_rfc3161_request(sig, md);
-	} else {
+	else
 		bout = encode_authenticode_request(sig);
-	}
 	if (!bout)
 		return 1; /* FAILED */
 	len = BIO_get_mem_data(bout, &p);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, len);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (char*)p);
 
-	bin = BIO_new(BIO_s_mem());
-	BIO_set_mem_eof_return(bin, 0);
-	curl_easy_setopt(curl, CURLOPT_POST, 1);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, bin);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
-	/* Perform the request */
-	res = curl_easy_perform(curl);
-	curl_slist_free_all(slist);
-	BIO_free_all(bout);
+	for (i = 0; i < nurls; i++) {
+		bins[i] = NULL;
+		slists[i] = NULL;
+		active[i] = 0;
+		if (!ts_pool[i])
+			ts_pool[i] = curl_easy_init();
+		if (!ts_pool[i])
+			continue;
+		bins[i] = BIO_new(BIO_s_mem());
+		BIO_set_mem_eof_return(bins[i], 0);
+		slists[i] = ts_handle_setup(ts_pool[i], urls[i], proxy, rfc3161,
+			noverifypeer, (char*)p, len, bins[i]);
+		if (curl_multi_add_handle(ts_multi, ts_pool[i]) == CURLM_OK) {
+			active[i] = 1;
+			nactive++;
+		}
+	}
+	while (nactive > 0) {
+		CURLMsg *msg;
+		int queued;
 
-	if (res != CURLE_OK) {
-		BIO_free_all(bin);
-		if (verbose)
-			printf("CURL failure: %s %s\n", curl_easy_strerror(res), url);
-	} else {
-		/* CURLE_OK (0) */
-		long http_code = -1;
-		(void)BIO_flush(bin);
-		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-		/* Decode a curl response from BIO and write it into the PKCS7 structure */
-		if (rfc3161)
-			res = decode_rfc3161_response(sig, bin, verbose);
-		else
-			res = decode_authenticode_response(sig, bin, verbose);
-		if (res && verbose)
-			print_timestamp_error(url, http_code);
+		if (curl_multi_perform(ts_multi, &running) != CURLM_OK)
+			break;
+		/* harvest completed transfers */
+		while ((msg = curl_multi_info_read(ts_multi, &queued))) {
+			CURLcode res;
+
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			for (i = 0; i < nurls; i++)
+				if (ts_pool[i] == msg->easy_handle)
+					break;
+			if (i == nurls)
+				continue;
+			res = msg->data.result;
+			curl_multi_remove_handle(ts_multi, ts_pool[i]);
+			active[i] = 0;
+			nactive--;
+			if (res != CURLE_OK) {
+				if (verbose)
+					printf("CURL failure: %s %s\n", curl_easy_strerror(res), urls[i]);
+			} else if (winner < 0) {
+				long http_code = -1;
+
+				(void)BIO_flush(bins[i]);
+				curl_easy_getinfo(ts_pool[i], CURLINFO_RESPONSE_CODE, &http_code);
+				/* decode the response and write it into the PKCS7 structure,
+				 * the decoder takes ownership of the response BIO */
+				if (rfc3161)
+					res = decode_rfc3161_response(sig, bins[i], verbose);
+				else
+					res = decode_authenticode_response(sig, bins[i], verbose);
+				bins[i] = NULL;
+				if (!res)
+					winner = i;
+				else if (verbose)
+					print_timestamp_error(urls[i], http_code);
+			}
+		}
+		if (winner >= 0 || nactive == 0)
+			break;
+		if (running > 0)
+			curl_multi_wait(ts_multi, NULL, 0, 100, NULL);
 	}
-	/* End a libcurl easy handle */
-	curl_easy_cleanup(curl);
-	return (int)res;
+	/* abort the transfers that lost the race and drop dangling pointers */
+	for (i = 0; i < nurls; i++) {
+		if (active[i])
+			curl_multi_remove_handle(ts_multi, ts_pool[i]);
+		if (ts_pool[i])
+			ts_handle_reset(ts_pool[i], slists[i]);
+		BIO_free_all(bins[i]);
+	}
+	BIO_free_all(bout);
+	return winner < 0 ? 1 : 0;
 }
 
-static int add_timestamp_authenticode(PKCS7 *sig, GLOBAL_OPTIONS *options)
+/* release the persistent timestamp client state */
+static void ts_pool_cleanup(void)
 {
 	int i;
-	for (i=0; i<options->nturl; i++) {
-		int res = add_timestamp(sig, options->turl[i], options->proxy, 0, NULL,
-				options->verbose || options->nturl == 1, options->noverifypeer);
-		if (!res)
-			return 0; /* OK */
+
+	for (i = 0; i < MAX_TS_SERVERS; i++) {
+		if (ts_pool[i]) {
+			curl_easy_cleanup(ts_pool[i]);
+			ts_pool[i] = NULL;
+		}
 	}
-	return 1; /* FAILED */
+	if (ts_multi) {
+		curl_multi_cleanup(ts_multi);
+		ts_multi = NULL;
+	}
+}
+
+static int add_timestamp_authenticode(PKCS7 *sig, GLOBAL_OPTIONS *options)
+{
+	return add_timestamp(sig, options->turl, options->nturl, options->proxy, 0, NULL,
+		options->verbose || options->nturl == 1, options->noverifypeer);
 }
 
 static int add_timestamp_rfc3161(PKCS7 *sig, GLOBAL_OPTIONS *options)
 {
-	int i;
-	for (i=0; i<options->ntsurl; i++) {
-		int res = add_timestamp(sig, options->tsurl[i], options->proxy, 1, options->md,
-				options->verbose || options->ntsurl == 1, options->noverifypeer);
-		if (!res)
-			return 0; /* OK */
-	}
-	return 1; /* FAILED */
+	return add_timestamp(sig, options->tsurl, options->ntsurl, options->proxy, 1, options->md,
+		options->verbose || options->ntsurl == 1, options->noverifypeer);
 }
 #endif /* ENABLE_CURL */
 
@@ -1179,11 +1493,14 @@ static void usage(const char *argv0, const char *cmd)
 {
 	const char *cmds_all[] = {"all", NULL};
 	const char *cmds_sign[] = {"all", "sign", NULL};
+	const char *cmds_sign_batch[] = {"all", "sign-batch", NULL};
+	const char *cmds_daemon[] = {"all", "daemon", NULL};
 	const char *cmds_add[] = {"all", "add", NULL};
 	const char *cmds_attach[] = {"all", "attach-signature", NULL};
 	const char *cmds_extract[] = {"all", "extract-signature", NULL};
 	const char *cmds_remove[] = {"all", "remove-signature", NULL};
 	const char *cmds_verify[] = {"all", "verify", NULL};
+	const char *cmds_verify_batch[] = {"all", "verify-batch", NULL};
 
 	printf("\nUsage: %s", argv0);
 	if (on_list(cmd, cmds_all)) {
@@ -1203,6 +1520,8 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -h {md5,sha1,sha2(56),sha384,sha512} ]\n", "");
 		printf("%12s[ -n <desc> ] [ -i <url> ] [ -jp <level> ] [ -comm ]\n", "");
 		printf("%12s[ -ph ]\n", "");
+		printf("%12s[ -threads <n> ]\n", "");
+		printf("%12s[ -digest-cache <dir> ]\n", "");
 #ifdef ENABLE_CURL
 		printf("%12s[ -t <timestampurl> [ -t ... ] [ -p <proxy> ] [ -noverifypeer  ]\n", "");
 		printf("%12s[ -ts <timestampurl> [ -ts ... ] [ -p <proxy> ] [ -noverifypeer ] ]\n", "");
@@ -1210,10 +1529,65 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -time <unix-time> ]\n", "");
 		printf("%12s[ -addUnauthenticatedBlob ]\n", "");
 		printf("%12s[ -nest ]\n", "");
+		printf("%12s[ -perf-stats ]\n", "");
 		printf("%12s[ -verbose ]\n", "");
 		printf("%12s[ -add-msi-dse ]\n", "");
 		printf("%12s[ -in ] <infile> [-out ] <outfile>\n\n", "");
 	}
+	if (on_list(cmd, cmds_sign_batch)) {
+		printf("%1ssign-batch ( -certs | -spc <certfile> -key <keyfile> | -pkcs12 <pkcs12file> |\n", "");
+		printf("%12s  [ -pkcs11engine <engine> ] -pkcs11module <module> -pkcs11cert <pkcs11 cert id> |\n", "");
+		printf("%12s  -certs <certfile> -key <pkcs11 key id>)\n", "");
+		printf("%12s[ -pass <password>", "");
+#ifdef PROVIDE_ASKPASS
+		printf("%1s [ -askpass ]", "");
+#endif /* PROVIDE_ASKPASS */
+		printf("%1s[ -readpass <file> ]\n", "");
+		printf("%12s[ -ac <crosscertfile> ]\n", "");
+		printf("%12s[ -h {md5,sha1,sha2(56),sha384,sha512} ]\n", "");
+		printf("%12s[ -n <desc> ] [ -i <url> ] [ -jp <level> ] [ -comm ]\n", "");
+		printf("%12s[ -ph ]\n", "");
+		printf("%12s[ -threads <n> ]\n", "");
+		printf("%12s[ -digest-cache <dir> ]\n", "");
+#ifdef ENABLE_CURL
+		printf("%12s[ -t <timestampurl> [ -t ... ] [ -p <proxy> ] [ -noverifypeer  ]\n", "");
+		printf("%12s[ -ts <timestampurl> [ -ts ... ] [ -p <proxy> ] [ -noverifypeer ] ]\n", "");
+#endif /* ENABLE_CURL */
+		printf("%12s[ -time <unix-time> ]\n", "");
+		printf("%12s[ -addUnauthenticatedBlob ]\n", "");
+		printf("%12s[ -nest ]\n", "");
+		printf("%12s[ -perf-stats ]\n", "");
+		printf("%12s[ -verbose ]\n", "");
+		printf("%12s[ -add-msi-dse ]\n", "");
+		printf("%12s[ -in ] <manifest>\n\n", "");
+	}
+	if (on_list(cmd, cmds_daemon)) {
+		printf("%1sdaemon ( -certs | -spc <certfile> -key <keyfile> | -pkcs12 <pkcs12file> |\n", "");
+		printf("%12s  [ -pkcs11engine <engine> ] -pkcs11module <module> -pkcs11cert <pkcs11 cert id> |\n", "");
+		printf("%12s  -certs <certfile> -key <pkcs11 key id>)\n", "");
+		printf("%12s[ -pass <password>", "");
+#ifdef PROVIDE_ASKPASS
+		printf("%1s [ -askpass ]", "");
+#endif /* PROVIDE_ASKPASS */
+		printf("%1s[ -readpass <file> ]\n", "");
+		printf("%12s[ -ac <crosscertfile> ]\n", "");
+		printf("%12s[ -h {md5,sha1,sha2(56),sha384,sha512} ]\n", "");
+		printf("%12s[ -n <desc> ] [ -i <url> ] [ -jp <level> ] [ -comm ]\n", "");
+		printf("%12s[ -ph ]\n", "");
+		printf("%12s[ -threads <n> ]\n", "");
+		printf("%12s[ -digest-cache <dir> ]\n", "");
+#ifdef ENABLE_CURL
+		printf("%12s[ -t <timestampurl> [ -t ... ] [ -p <proxy> ] [ -noverifypeer  ]\n", "");
+		printf("%12s[ -ts <timestampurl> [ -ts ... ] [ -p <proxy> ] [ -noverifypeer ] ]\n", "");
+#endif /* ENABLE_CURL */
+		printf("%12s[ -time <unix-time> ]\n", "");
+		printf("%12s[ -addUnauthenticatedBlob ]\n", "");
+		printf("%12s[ -nest ]\n", "");
+		printf("%12s[ -perf-stats ]\n", "");
+		printf("%12s[ -verbose ]\n", "");
+		printf("%12s[ -add-msi-dse ]\n", "");
+		printf("%12s-socket <sockfile>\n\n", "");
+	}
 	if (on_list(cmd, cmds_add)) {
 		printf("%1sadd [-addUnauthenticatedBlob]\n", "");
 #ifdef ENABLE_CURL
@@ -1221,6 +1595,7 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -ts <timestampurl> [ -ts ... ] [ -p <proxy> ] [ -noverifypeer ] ]\n", "");
 #endif /* ENABLE_CURL */
 		printf("%12s[ -h {md5,sha1,sha2(56),sha384,sha512} ]\n", "");
+		printf("%12s[ -perf-stats ]\n", "");
 		printf("%12s[ -verbose ]\n", "");
 		printf("%12s[ -add-msi-dse ]\n", "");
 		printf("%12s[ -in ] <infile> [ -out ] <outfile>\n\n", "");
@@ -1234,6 +1609,7 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -time <unix-time> ]\n", "");
 		printf("%12s[ -h {md5,sha1,sha2(56),sha384,sha512} ]\n", "");
 		printf("%12s[ -require-leaf-hash {md5,sha1,sha2(56),sha384,sha512}:XXXXXXXXXXXX... ]\n", "");
+		printf("%12s[ -threads <n> ]\n", "");
 		printf("%12s[ -nest ]\n", "");
 		printf("%12s[ -add-msi-dse ]\n", "");
 		printf("%12s[ -in ] <infile> [ -out ] <outfile>\n\n", "");
@@ -1252,8 +1628,26 @@ static void usage(const char *argv0, const char *cmd)
 		printf("%12s[ -TSA-CAfile <infile> ]\n", "");
 		printf("%12s[ -TSA-CRLfile <infile> ]\n", "");
 		printf("%12s[ -ignore_timestamp ]\n", "");
+		printf("%12s[ -fast ]\n", "");
+		printf("%12s[ -time <unix-time> ]\n", "");
+		printf("%12s[ -require-leaf-hash {md5,sha1,sha2(56),sha384,sha512}:XXXXXXXXXXXX... ]\n", "");
+		printf("%12s[ -threads <n> ]\n", "");
+		printf("%12s[ -perf-stats ]\n", "");
+		printf("%12s[ -verbose ]\n\n", "");
+	}
+	if (on_list(cmd, cmds_verify_batch)) {
+		printf("%1sverify-batch [ -in ] <manifest>\n", "");
+		printf("%12s[ -c | -catalog <infile> ]\n", "");
+		printf("%12s[ -CAfile <infile> ]\n", "");
+		printf("%12s[ -CRLfile <infile> ]\n", "");
+		printf("%12s[ -TSA-CAfile <infile> ]\n", "");
+		printf("%12s[ -TSA-CRLfile <infile> ]\n", "");
+		printf("%12s[ -ignore_timestamp ]\n", "");
+		printf("%12s[ -fast ]\n", "");
 		printf("%12s[ -time <unix-time> ]\n", "");
 		printf("%12s[ -require-leaf-hash {md5,sha1,sha2(56),sha384,sha512}:XXXXXXXXXXXX... ]\n", "");
+		printf("%12s[ -threads <n> ]\n", "");
+		printf("%12s[ -perf-stats ]\n", "");
 		printf("%12s[ -verbose ]\n\n", "");
 	}
 }
@@ -1266,51 +1660,60 @@ static void help_for(const char *argv0, const char *cmd)
 	const char *cmds_extract[] = {"extract-signature", NULL};
 	const char *cmds_remove[] = {"remove-signature", NULL};
 	const char *cmds_sign[] = {"sign", NULL};
+	const char *cmds_sign_batch[] = {"sign-batch", NULL};
+	const char *cmds_daemon[] = {"daemon", NULL};
 	const char *cmds_verify[] = {"verify", NULL};
-	const char *cmds_ac[] = {"sign", NULL};
-	const char *cmds_add_msi_dse[] = {"add", "attach-signature", "sign", NULL};
-	const char *cmds_addUnauthenticatedBlob[] = {"sign", "add", NULL};
+	const char *cmds_verify_batch[] = {"verify-batch", NULL};
+	const char *cmds_ac[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_add_msi_dse[] = {"add", "attach-signature", "daemon", "sign", "sign-batch", NULL};
+	const char *cmds_addUnauthenticatedBlob[] = {"daemon", "sign", "sign-batch", "add", NULL};
 #ifdef PROVIDE_ASKPASS
-	const char *cmds_askpass[] = {"sign", NULL};
+	const char *cmds_askpass[] = {"daemon", "sign", "sign-batch", NULL};
 #endif /* PROVIDE_ASKPASS */
-	const char *cmds_CAfile[] = {"attach-signature", "verify", NULL};
-	const char *cmds_catalog[] = {"verify", NULL};
-	const char *cmds_certs[] = {"sign", NULL};
-	const char *cmds_comm[] = {"sign", NULL};
-	const char *cmds_CRLfile[] = {"attach-signature", "verify", NULL};
-	const char *cmds_CRLfileTSA[] = {"attach-signature", "verify", NULL};
-	const char *cmds_h[] = {"add", "attach-signature", "sign", NULL};
-	const char *cmds_i[] = {"sign", NULL};
-	const char *cmds_in[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", "verify", NULL};
-	const char *cmds_jp[] = {"sign", NULL};
-	const char *cmds_key[] = {"sign", NULL};
-	const char *cmds_n[] = {"sign", NULL};
-	const char *cmds_nest[] = {"attach-signature", "sign", NULL};
+	const char *cmds_CAfile[] = {"attach-signature", "verify", "verify-batch", NULL};
+	const char *cmds_catalog[] = {"verify", "verify-batch", NULL};
+	const char *cmds_certs[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_comm[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_CRLfile[] = {"attach-signature", "verify", "verify-batch", NULL};
+	const char *cmds_digest_cache[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_fast[] = {"verify", "verify-batch", NULL};
+	const char *cmds_CRLfileTSA[] = {"attach-signature", "verify", "verify-batch", NULL};
+	const char *cmds_h[] = {"add", "attach-signature", "daemon", "sign", "sign-batch", NULL};
+	const char *cmds_i[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_in[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", "sign-batch", "verify", "verify-batch", NULL};
+	const char *cmds_inplace[] = {"add", "sign", NULL};
+	const char *cmds_jp[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_key[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_n[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_nest[] = {"attach-signature", "daemon", "sign", "sign-batch", NULL};
 #ifdef ENABLE_CURL
-	const char *cmds_noverifypeer[] = {"add", "sign", NULL};
+	const char *cmds_noverifypeer[] = {"add", "daemon", "sign", "sign-batch", NULL};
 #endif /* ENABLE_CURL */
 	const char *cmds_out[] = {"add", "attach-signature", "extract-signature", "remove-signature", "sign", NULL};
 #ifdef ENABLE_CURL
-	const char *cmds_p[] = {"add", "sign", NULL};
+	const char *cmds_p[] = {"add", "daemon", "sign", "sign-batch", NULL};
 #endif /* ENABLE_CURL */
-	const char *cmds_pass[] = {"sign", NULL};
+	const char *cmds_pass[] = {"daemon", "sign", "sign-batch", NULL};
 	const char *cmds_pem[] = {"extract-signature", NULL};
-	const char *cmds_ph[] = {"sign", NULL};
-	const char *cmds_pkcs11cert[] = {"sign", NULL};
-	const char *cmds_pkcs11engine[] = {"sign", NULL};
-	const char *cmds_pkcs11module[] = {"sign", NULL};
-	const char *cmds_pkcs12[] = {"sign", NULL};
-	const char *cmds_readpass[] = {"sign", NULL};
-	const char *cmds_require_leaf_hash[] = {"attach-signature", "verify", NULL};
+	const char *cmds_ph[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_pkcs11cert[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_pkcs11engine[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_pkcs11module[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_pkcs12[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_readpass[] = {"daemon", "sign", "sign-batch", NULL};
+	const char *cmds_require_leaf_hash[] = {"attach-signature", "verify", "verify-batch", NULL};
 	const char *cmds_sigin[] = {"attach-signature", NULL};
-	const char *cmds_time[] = {"attach-signature", "sign", "verify", NULL};
-	const char *cmds_ignore_timestamp[] = {"verify", NULL};
+	const char *cmds_socket[] = {"daemon", NULL};
+	const char *cmds_time[] = {"attach-signature", "daemon", "sign", "sign-batch", "verify", "verify-batch", NULL};
+	const char *cmds_ignore_timestamp[] = {"verify", "verify-batch", NULL};
 #ifdef ENABLE_CURL
-	const char *cmds_t[] = {"add", "sign", NULL};
-	const char *cmds_ts[] = {"add", "sign", NULL};
+	const char *cmds_t[] = {"add", "daemon", "sign", "sign-batch", NULL};
+	const char *cmds_ts[] = {"add", "daemon", "sign", "sign-batch", NULL};
 #endif /* ENABLE_CURL */
-	const char *cmds_CAfileTSA[] = {"attach-signature", "verify", NULL};
-	const char *cmds_verbose[] = {"add", "sign", "verify", NULL};
+	const char *cmds_CAfileTSA[] = {"attach-signature", "verify", "verify-batch", NULL};
+	const char *cmds_threads[] = {"attach-signature", "daemon", "sign", "sign-batch", "verify", "verify-batch", NULL};
+	const char *cmds_verbose[] = {"add", "daemon", "sign", "sign-batch", "verify", "verify-batch", NULL};
+	const char *cmds_perf_stats[] = {"add", "daemon", "sign", "sign-batch", "verify", "verify-batch", NULL};
 
 	if (on_list(cmd, cmds_all)) {
 		printf("osslsigncode is a small tool that implements part of the functionality of the Microsoft\n");
@@ -1326,7 +1729,10 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("%-22s = extract signature from a previously-signed file\n", "extract-signature");
 		printf("%-22s = remove sections of the embedded signature on a file\n", "remove-signature");
 		printf("%-22s = digitally sign a file\n", "sign");
-		printf("%-22s = verifies the digital signature of a file\n\n", "verify");
+		printf("%-22s = digitally sign files listed in a manifest with a single key load\n", "sign-batch");
+		printf("%-22s = serve sign and verify jobs over a unix socket with a warm key\n", "daemon");
+		printf("%-22s = verifies the digital signature of a file\n", "verify");
+		printf("%-22s = verify the digital signatures of files listed in a manifest\n\n", "verify-batch");
 		printf("For help on a specific command, enter %s <command> --help\n", argv0);
 	}
 	if (on_list(cmd, cmds_add)) {
@@ -1355,6 +1761,25 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("parameters and to select the signing certificate you wish to use.\n\n");
 		printf("Options:\n");
 	}
+	if (on_list(cmd, cmds_sign_batch)) {
+		printf("\nUse the \"sign-batch\" command to sign several files with a single key and certificate load.\n");
+		printf("The key, the certificate chain and any PKCS#11 token session are set up once and reused\n");
+		printf("for every entry of the manifest. The manifest is a text file passed with the \"-in\" option;\n");
+		printf("each line contains an input file name and an output file name separated by whitespace.\n");
+		printf("Blank lines and lines starting with \"#\" are ignored. With \"-threads\" greater than\n");
+		printf("one a pool of worker processes signs several entries concurrently, so hashing one\n");
+		printf("file overlaps the Time-Stamp Authority round-trip of another.\n\n");
+		printf("Options:\n");
+	}
+	if (on_list(cmd, cmds_daemon)) {
+		printf("\nUse the \"daemon\" command to serve sign and verify jobs over a unix socket.\n");
+		printf("The key, the certificate chain and any PKCS#11 token session are set up once when\n");
+		printf("the daemon starts and stay resident for every job, avoiding the per-file engine\n");
+		printf("initialization cost. Each connection carries one newline-terminated job:\n");
+		printf("\"sign <infile> <outfile>\", \"verify <infile>\" or \"quit\"; the daemon replies\n");
+		printf("with \"OK\" or \"FAILED\" and closes the connection.\n\n");
+		printf("Options:\n");
+	}
 	if (on_list(cmd, cmds_verify)) {
 		printf("\nUse the \"verify\" command to verify embedded signatures.\n");
 		printf("Verification determines if the signing certificate was issued by a trusted party,\n");
@@ -1363,6 +1788,16 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("and to specify how to find needed CA or TSA certificates, if appropriate.\n\n");
 		printf("Options:\n");
 	}
+	if (on_list(cmd, cmds_verify_batch)) {
+		printf("\nUse the \"verify-batch\" command to verify every file listed in a manifest.\n");
+		printf("The manifest is a text file passed with the \"-in\" option; each line contains one\n");
+		printf("input file name. Blank lines and lines starting with \"#\" are ignored. When the\n");
+		printf("\"-catalog\" option is used, the catalog file is decoded and indexed only once\n");
+		printf("for all of the files. With \"-threads\" greater than one a pool of worker\n");
+		printf("processes verifies several files concurrently; an idle worker picks up the next\n");
+		printf("manifest entry, and each file's report is printed as one block on completion.\n\n");
+		printf("Options:\n");
+	}
 	if (on_list(cmd, cmds_ac))
 	printf("%-24s= additional certificates to be added to the signature block\n", "-ac");
 	if (on_list(cmd, cmds_add_msi_dse))
@@ -1383,6 +1818,15 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("%-24s= set commercial purpose (default: individual purpose)\n", "-comm");
 	if (on_list(cmd, cmds_CRLfile))
 		printf("%-24s= the file containing one or more CRLs in PEM format\n", "-CRLfile");
+	if (on_list(cmd, cmds_digest_cache)) {
+		printf("%-24s= the directory caching computed digests keyed by the input\n", "-digest-cache");
+		printf("%26sfile identity (path, size, mtime); an unchanged file skips\n", "");
+		printf("%26sthe hashing pass on re-sign\n", "");
+	}
+	if (on_list(cmd, cmds_fast)) {
+		printf("%-24s= stop at the first signature that verifies successfully\n", "-fast");
+		printf("%26sinstead of checking every signature of the file\n", "");
+	}
 	if (on_list(cmd, cmds_h)) {
 		printf("%-24s= {md5|sha1|sha2(56)|sha384|sha512}\n", "-h");
 		printf("%26sset of cryptographic hash functions\n", "");
@@ -1391,6 +1835,10 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("%-24s= specifies a URL for expanded description of the signed content\n", "-i");
 	if (on_list(cmd, cmds_in))
 		printf("%-24s= input file\n", "-in");
+	if (on_list(cmd, cmds_inplace)) {
+		printf("%-24s= update the signature of a PE input file in place\n", "-inplace");
+		printf("%26sonly the certificate table is rewritten, no output file is created\n", "");
+	}
 	if (on_list(cmd, cmds_jp)) {
 		printf("%-24s= low | medium | high\n", "-jp");
 		printf("%26slevels of permissions in Microsoft Internet Explorer 4.x for CAB files\n", "");
@@ -1436,6 +1884,8 @@ static void help_for(const char *argv0, const char *cmd)
 	}
 	if (on_list(cmd, cmds_sigin))
 		printf("%-24s= a file containing the signature to be attached\n", "-sigin");
+	if (on_list(cmd, cmds_socket))
+		printf("%-24s= the unix socket path to listen on\n", "-socket");
 	if (on_list(cmd, cmds_ignore_timestamp))
 		printf("%-24s= disable verification of the Timestamp Server signature\n", "-ignore-timestamp");
 #ifdef ENABLE_CURL
@@ -1455,6 +1905,12 @@ static void help_for(const char *argv0, const char *cmd)
 		printf("%-24s= the file containing one or more Time-Stamp Authority certificates in PEM format\n", "-TSA-CAfile");
 	if (on_list(cmd, cmds_CRLfileTSA))
 		printf("%-24s= the file containing one or more Time-Stamp Authority CRLs in PEM format\n", "-TSA-CRLfile");
+	if (on_list(cmd, cmds_perf_stats))
+		printf("%-24s= print a JSON summary of per-phase timings and byte counts to stderr\n", "-perf-stats");
+	if (on_list(cmd, cmds_threads)) {
+		printf("%-24s= the number of parallel workers: PE page hash threads, per-signature\n", "-threads");
+		printf("%26sverify processes and per-file processes for sign-batch/verify-batch\n", "");
+	}
 	if (on_list(cmd, cmds_verbose))
 		printf("%-24s= include additional output in the log\n", "-verbose");
 	usage(argv0, cmd);
@@ -1474,9 +1930,12 @@ typedef enum {
 
 typedef enum {
 	CMD_SIGN,
+	CMD_SIGN_BATCH,
+	CMD_DAEMON,
 	CMD_EXTRACT,
 	CMD_REMOVE,
 	CMD_VERIFY,
+	CMD_VERIFY_BATCH,
 	CMD_ADD,
 	CMD_ATTACH,
 	CMD_HELP
@@ -1500,19 +1959,67 @@ static SpcLink *get_obsolete_link(void)
 	return link;
 }
 
+/* A contiguous range of pages hashed by one worker */
+typedef struct {
+	char *indata;
+	const u_char *zeroes;
+	u_char *res;           /* preallocated result array */
+	const uint32_t *pg_off; /* per-page file offset */
+	const uint32_t *pg_len; /* per-page data length */
+	uint32_t pagesize;
+	int pphlen;
+	int phtype;
+	int begin;
+	int end;
+	int ok;
+} PAGE_HASH_TASK;
+
+/* Hash the pages [begin, end), writing results at fixed offsets into res */
+static void *page_hash_worker(void *arg)
+{
+	PAGE_HASH_TASK *task = arg;
+	int i;
+	/* the implementation was cached by pe_calc_page_hash() before the
+	   workers started, so this lookup is a read-only cache hit */
+	const EVP_MD *md = md_by_nid(task->phtype);
+	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+
+	task->ok = 0;
+	for (i = task->begin; i < task->end; i++) {
+		u_char *p = task->res + (size_t)(i + 1) * (size_t)task->pphlen;
+		PUT_UINT32_LE(task->pg_off[i], p);
+		if (!EVP_DigestInit(mdctx, md)) {
+			EVP_MD_CTX_free(mdctx);
+			return NULL; /* FAILED */
+		}
+		EVP_DigestUpdate(mdctx, task->indata + task->pg_off[i], task->pg_len[i]);
+		if (task->pg_len[i] < task->pagesize)
+			EVP_DigestUpdate(mdctx, task->zeroes, task->pagesize - task->pg_len[i]);
+		EVP_DigestFinal(mdctx, p + 4, NULL);
+	}
+	task->ok = 1;
+	EVP_MD_CTX_free(mdctx);
+	return NULL;
+}
+
+/*
+ * Every page digest is independent, so the flattened page list is
+ * partitioned across nthreads workers when POSIX threads are available.
+ */
 static u_char *pe_calc_page_hash(char *indata, uint32_t header_size,
-	uint32_t pe32plus, uint32_t sigpos, int phtype, int *rphlen)
+	uint32_t pe32plus, uint32_t sigpos, int phtype, int nthreads, int *rphlen)
 {
 	uint16_t nsections, opthdr_size;
 	uint32_t pagesize, hdrsize;
 	uint32_t rs, ro, l, lastpos = 0;
-	int pphlen, phlen, i, pi = 1;
+	uint32_t *pg_off, *pg_len;
+	int pphlen, phlen, i, t, npages = 0;
 	u_char *res, *zeroes;
 	char *sections;
-	const EVP_MD *md = EVP_get_digestbynid(phtype);
-	EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
-	if (!EVP_DigestInit(mdctx, md)) {
-		EVP_MD_CTX_free(mdctx);
+	PAGE_HASH_TASK *tasks;
+	const EVP_MD *md = md_by_nid(phtype);
+	EVP_MD_CTX *mdctx = md_ctx_get(md);
+	if (!mdctx) {
 		printf("Unable to set up the digest context\n");
 		return NULL;  /* FAILED */
 	}
@@ -1532,36 +2039,88 @@ static u_char *pe_calc_page_hash(char *indata, uint32_t header_size,
 	EVP_DigestUpdate(mdctx, zeroes, pagesize - hdrsize);
 	memset(res, 0, 4);
 	EVP_DigestFinal(mdctx, res + 4, NULL);
+	md_ctx_put(mdctx);
 
+	/* flatten the section list into a per-page work list */
+	pg_off = OPENSSL_malloc((size_t)(2 + nsections + sigpos / pagesize) * sizeof(uint32_t));
+	pg_len = OPENSSL_malloc((size_t)(2 + nsections + sigpos / pagesize) * sizeof(uint32_t));
 	opthdr_size = GET_UINT16_LE(indata + header_size + 20);
 	sections = indata + header_size + 24 + opthdr_size;
 	for (i=0; i<nsections; i++) {
 		rs = GET_UINT32_LE(sections + 16);
 		ro = GET_UINT32_LE(sections + 20);
-		for (l=0; l < rs; l+=pagesize, pi++) {
-			PUT_UINT32_LE(ro + l, res + pi*pphlen);
-			EVP_DigestInit(mdctx, md);
-			if (rs - l < pagesize) {
-				EVP_DigestUpdate(mdctx, indata + ro + l, rs - l);
-				EVP_DigestUpdate(mdctx, zeroes, pagesize - (rs - l));
-			} else {
-				EVP_DigestUpdate(mdctx, indata + ro + l, pagesize);
-			}
-			EVP_DigestFinal(mdctx, res + pi*pphlen + 4, NULL);
+		for (l=0; l < rs; l+=pagesize, npages++) {
+			pg_off[npages] = ro + l;
+			pg_len[npages] = rs - l < pagesize ? rs - l : pagesize;
 		}
 		lastpos = ro + rs;
 		sections += 40;
 	}
-	EVP_MD_CTX_free(mdctx);
-	PUT_UINT32_LE(lastpos, res + pi*pphlen);
-	memset(res + pi*pphlen + 4, 0, (size_t)EVP_MD_size(md));
-	pi++;
-	OPENSSL_free(zeroes);
-	*rphlen = pi*pphlen;
-	return res;
-}
+	if (nthreads > npages)
+		nthreads = npages > 0 ? npages : 1;
+#ifndef HAVE_PTHREAD_H
+	nthreads = 1;
+#endif /* HAVE_PTHREAD_H */
+	tasks = OPENSSL_malloc((size_t)nthreads * sizeof(PAGE_HASH_TASK));
+	for (t = 0; t < nthreads; t++) {
+		tasks[t].indata = indata;
+		tasks[t].zeroes = zeroes;
+		tasks[t].res = res;
+		tasks[t].pg_off = pg_off;
+		tasks[t].pg_len = pg_len;
+		tasks[t].pagesize = pagesize;
+		tasks[t].pphlen = pphlen;
+		tasks[t].phtype = phtype;
+		tasks[t].begin = npages * t / nthreads;
+		tasks[t].end = npages * (t + 1) / nthreads;
+		tasks[t].ok = 0;
+	}
+#ifdef HAVE_PTHREAD_H
+	if (nthreads > 1) {
+		int created;
+		pthread_t *tids = OPENSSL_malloc((size_t)nthreads * sizeof(pthread_t));
+		for (t = 1; t < nthreads; t++) {
+			if (pthread_create(&tids[t], NULL, page_hash_worker, &tasks[t]))
+				break;
+		}
+		created = t;
+		/* thread creation failed, run the remaining tasks in this thread */
+		for (; t < nthreads; t++) {
+			page_hash_worker(&tasks[t]);
+		}
+		page_hash_worker(&tasks[0]);
+		for (t = 1; t < created; t++) {
+			pthread_join(tids[t], NULL);
+		}
+		OPENSSL_free(tids);
+	} else {
+		page_hash_worker(&tasks[0]);
+	}
+#else /* HAVE_PTHREAD_H */
+	page_hash_worker(&tasks[0]);
+#endif /* HAVE_PTHREAD_H */
+	for (t = 0; t < nthreads; t++) {
+		if (!tasks[t].ok) {
+			printf("Unable to set up the digest context\n");
+			OPENSSL_free(tasks);
+			OPENSSL_free(pg_off);
+			OPENSSL_free(pg_len);
+			OPENSSL_free(zeroes);
+			OPENSSL_free(res);
+			return NULL; /* FAILED */
+		}
+	}
+	OPENSSL_free(tasks);
+	OPENSSL_free(pg_off);
+	OPENSSL_free(pg_len);
+	PUT_UINT32_LE(lastpos, res + (npages + 1)*pphlen);
+	memset(res + (npages + 1)*pphlen + 4, 0, (size_t)EVP_MD_size(md));
+	OPENSSL_free(zeroes);
+	*rphlen = (npages + 2)*pphlen;
+	return res;
+}
 
-static SpcLink *get_page_hash_link(int phtype, char *indata, FILE_HEADER *header)
+static SpcLink *get_page_hash_link(int phtype, char *indata, FILE_HEADER *header, int nthreads)
 {
 	u_char *ph, *p, *tmp;
 	int l, phlen;
@@ -1573,7 +2132,7 @@ static SpcLink *get_page_hash_link(int phtype, char *indata, FILE_HEADER *header
 	STACK_OF(ASN1_TYPE) *oset, *aset;
 
 	ph = pe_calc_page_hash(indata, header->header_size, header->pe32plus,
-			header->fileend, phtype, &phlen);
+			header->fileend, phtype, nthreads, &phlen);
 	if (!ph) {
 		printf("Failed to calculate page hash\n");
 		return NULL; /* FAILED */
@@ -1666,7 +2225,7 @@ static int get_indirect_data_blob(u_char **blob, int *len, GLOBAL_OPTIONS *optio
 			phtype = NID_sha1;
 			if (EVP_MD_size(options->md) > EVP_MD_size(EVP_sha1()))
 				phtype = NID_sha256;
-			link = get_page_hash_link(phtype, indata, header);
+			link = get_page_hash_link(phtype, indata, header, options->threads);
 			if (!link)
 				return 0; /* FAILED */
 			pid->file = link;
@@ -1721,14 +2280,112 @@ static int get_indirect_data_blob(u_char **blob, int *len, GLOBAL_OPTIONS *optio
 	return 1; /* OK */
 }
 
-static int set_signing_blob(PKCS7 *sig, BIO *hash, u_char *buf, int len)
+/*
+ * Map a signing job onto its digest cache file.  The key covers the input
+ * file identity (path, size, mtime), the digest algorithm and the hashed
+ * header layout, so any change to the artifact or to the signing
+ * parameters misses the cache.
+ */
+static char *digest_cache_file(GLOBAL_OPTIONS *options, FILE_HEADER *header, file_type_t type)
+{
+	char buf[128], hex[2*EVP_MAX_MD_SIZE+1], *path;
+	u_char keymd[EVP_MAX_MD_SIZE];
+	u_int keymdlen, i;
+	size_t pathlen;
+	struct stat st;
+	EVP_MD_CTX *mdctx;
+
+	if (stat(options->infile, &st))
+		return NULL; /* FAILED */
+	mdctx = md_ctx_get(md_by_nid(NID_sha256));
+	if (!mdctx)
+		return NULL; /* FAILED */
+	EVP_DigestUpdate(mdctx, options->infile, strlen(options->infile) + 1);
+	BIO_snprintf(buf, sizeof buf, "%lld|%lld|%d|%d|%u|%u|%u|%u|%d|%d",
+		(long long)st.st_size, (long long)st.st_mtime,
+		(int)type, EVP_MD_nid(options->md), header->header_size,
+		header->sigpos, header->siglen, header->fileend,
+		options->add_msi_dse, options->pagehash);
+	EVP_DigestUpdate(mdctx, buf, strlen(buf) + 1);
+	EVP_DigestFinal_ex(mdctx, keymd, &keymdlen);
+	md_ctx_put(mdctx);
+	for (i = 0; i < keymdlen; i++)
+		sprintf(hex + 2*i, "%02x", keymd[i]);
+	pathlen = strlen(options->digest_cache) + 2*keymdlen + 7;
+	path = OPENSSL_malloc(pathlen);
+	snprintf(path, pathlen, "%s/%s.dgst", options->digest_cache, hex);
+	return path;
+}
+
+/*
+ * Map an MSI signing job onto its content-keyed digest cache file.  A
+ * rebuilt container misses the identity key even when every stream is
+ * unchanged, so MSI jobs get a second key derived from a fast content
+ * fingerprint of the directory tree, the digest algorithm and the
+ * signature flavour.  The Authenticode digest does not cover the
+ * signature streams, so the cached digest stays valid when only the
+ * signature of the container changed.
+ */
+static char *digest_cache_file_msi(GLOBAL_OPTIONS *options, const u_char *sum)
+{
+	char key[4096], hex[2*EVP_MAX_MD_SIZE+1], *path;
+	u_char keymd[EVP_MAX_MD_SIZE];
+	u_int keymdlen, i;
+	size_t pathlen;
+
+	snprintf(key, sizeof key, "msi|%02x%02x%02x%02x%02x%02x%02x%02x|%d|%d",
+		sum[0], sum[1], sum[2], sum[3], sum[4], sum[5], sum[6], sum[7],
+		EVP_MD_nid(options->md), options->add_msi_dse);
+	if (!EVP_Digest(key, strlen(key), keymd, &keymdlen, EVP_sha256(), NULL))
+		return NULL; /* FAILED */
+	for (i = 0; i < keymdlen; i++)
+		sprintf(hex + 2*i, "%02x", keymd[i]);
+	pathlen = strlen(options->digest_cache) + 2*keymdlen + 7;
+	path = OPENSSL_malloc(pathlen);
+	snprintf(path, pathlen, "%s/%s.dgst", options->digest_cache, hex);
+	return path;
+}
+
+static int digest_cache_read(char *path, u_char *mdbuf, int mdlen)
+{
+	FILE *fp = fopen(path, "rb");
+	int ok;
+
+	if (!fp)
+		return 0; /* FAILED */
+	ok = fread(mdbuf, 1, (size_t)mdlen, fp) == (size_t)mdlen && fgetc(fp) == EOF;
+	fclose(fp);
+	return ok;
+}
+
+static void digest_cache_store(char *path, u_char *mdbuf, int mdlen)
+{
+	FILE *fp = fopen(path, "wb");
+
+	if (!fp || fwrite(mdbuf, 1, (size_t)mdlen, fp) != (size_t)mdlen)
+		printf("Warning: Failed to write digest cache file: %s\n", path);
+	if (fp)
+		fclose(fp);
+}
+
+static int set_signing_blob(PKCS7 *sig, BIO *hash, u_char *buf, int len, GLOBAL_OPTIONS *options)
 {
 	u_char mdbuf[EVP_MAX_MD_SIZE];
 	int mdlen, seqhdrlen;
 	BIO *sigbio;
 	PKCS7 *td7;
 
-	mdlen = BIO_gets(hash, (char*)mdbuf, EVP_MAX_MD_SIZE);
+	if (options && options->cached_digest_len > 0) {
+		/* the digest came from the cache, the hashing chain was a no-op */
+		mdlen = options->cached_digest_len;
+		memcpy(mdbuf, options->cached_digest, (size_t)mdlen);
+	} else {
+		mdlen = BIO_gets(hash, (char*)mdbuf, EVP_MAX_MD_SIZE);
+		if (options && options->cachefile)
+			digest_cache_store(options->cachefile, mdbuf, mdlen);
+		if (options && options->content_cachefile)
+			digest_cache_store(options->content_cachefile, mdbuf, mdlen);
+	}
 	memcpy(buf+len, mdbuf, (size_t)mdlen);
 	seqhdrlen = asn1_simple_hdr_len(buf, len);
 
@@ -1798,13 +2455,16 @@ static int set_indirect_data_blob(PKCS7 *sig, BIO *hash, file_type_t type,
 {
 	u_char *p = NULL;
 	int len = 0;
-	u_char *buf = OPENSSL_malloc(SIZE_64K);
+	u_char *buf;
 
 	if (!get_indirect_data_blob(&p, &len, options, header, type, indata))
 		return 0; /* FAILED */
+	/* page hashes of large files overflow a fixed-size buffer;
+	   set_signing_blob() appends the message digest after the blob */
+	buf = OPENSSL_malloc((size_t)len + EVP_MAX_MD_SIZE);
 	memcpy(buf, p, (size_t)len);
 	OPENSSL_free(p);
-	if (!set_signing_blob(sig, hash, buf, len)) {
+	if (!set_signing_blob(sig, hash, buf, len, options)) {
 		OPENSSL_free(buf);
 		return 0; /* FAILED */
 	}
@@ -1813,30 +2473,71 @@ static int set_indirect_data_blob(PKCS7 *sig, BIO *hash, file_type_t type,
 	return 1; /* OK */
 }
 
+/*
+ * Sum 16-bit little-endian words into a 64-bit partial sum.
+ * Since 2^16 and 2^32 are both congruent to 1 (mod 0xffff), the carry
+ * folding can be deferred until the end instead of being performed after
+ * every 16-bit addition, which lets the loop consume 8 bytes at a time.
+ */
+static uint64_t pe_checksum_update(uint64_t sum, const u_char *buf, uint32_t len)
+{
+	uint32_t i = 0;
+
+	while (i + 8 <= len) {
+		sum += (uint64_t)GET_UINT32_LE(buf + i) + GET_UINT32_LE(buf + i + 4);
+		i += 8;
+	}
+	while (i + 2 <= len) {
+		sum += (uint32_t)(buf[i] | buf[i + 1] << 8);
+		i += 2;
+	}
+	return sum;
+}
+
+static uint32_t pe_checksum_final(uint64_t sum, uint32_t size)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint32_t)sum + size;
+}
+
+/* calculate the checksum directly on the in-memory file image */
+static uint32_t pe_calc_checksum_buf(char *indata, uint32_t size, FILE_HEADER *header)
+{
+	const u_char *data = (const u_char *)indata;
+	uint64_t sum;
+	uint32_t pos;
+
+	size &= ~1u; /* an odd trailing byte is not covered by the checksum */
+	sum = pe_checksum_update(0, data, size);
+	/* the checksum field itself is treated as zero */
+	for (pos = header->header_size + 88; pos < header->header_size + 92; pos += 2)
+		if (pos + 2 <= size)
+			sum -= (uint32_t)(data[pos] | data[pos + 1] << 8);
+	return pe_checksum_final(sum, size);
+}
+
 static uint32_t pe_calc_checksum(BIO *bio, FILE_HEADER *header)
 {
-	uint32_t checkSum = 0, size = 0;
+	uint64_t sum = 0;
+	uint32_t size = 0;
 	int nread;
-	unsigned short *buf = OPENSSL_malloc(SIZE_64K);
+	u_char *buf = OPENSSL_malloc(SIZE_64K);
 
 	/* recalculate the checksum */
 	(void)BIO_seek(bio, 0);
 	while ((nread = BIO_read(bio, buf, SIZE_64K)) > 0) {
-		unsigned short val;
-		int i;
-		for (i = 0; i < nread / 2; i++) {
-			val = buf[i];
-			if (size == header->header_size + 88 || size == header->header_size + 90)
-				val = 0;
-			checkSum += val;
-			checkSum = 0xffff & (checkSum + (checkSum >> 0x10));
-			size += 2;
-		}
+		uint32_t nbytes = (uint32_t)nread & ~1u, pos;
+
+		sum = pe_checksum_update(sum, buf, nbytes);
+		/* the checksum field itself is treated as zero */
+		for (pos = header->header_size + 88; pos < header->header_size + 92; pos += 2)
+			if (pos >= size && pos + 2 <= size + nbytes)
+				sum -= (uint32_t)(buf[pos - size] | buf[pos - size + 1] << 8);
+		size += nbytes;
 	}
 	OPENSSL_free(buf);
-	checkSum = 0xffff & (checkSum + (checkSum >> 0x10));
-	checkSum += size;
-	return checkSum;
+	return pe_checksum_final(sum, size);
 }
 
 static void pe_recalc_checksum(BIO *bio, FILE_HEADER *header)
@@ -1873,6 +2574,7 @@ static int verify_leaf_hash(X509 *leaf, const char *leafhash)
 		printf("\nUnable to lookup digest by name '%s'\n", mdid);
 		goto out;
 	}
+	md = md_by_nid(EVP_MD_nid(md)); /* prefer the cached implementation */
 	mdbuf = OPENSSL_hexstr2buf(hash, &mdlen);
 	if (mdlen != EVP_MD_size(md)) {
 		printf("\nHash length mismatch: '%s' digest must be %d bytes long (got %ld bytes)\n",
@@ -1880,9 +2582,8 @@ static int verify_leaf_hash(X509 *leaf, const char *leafhash)
 		goto out;
 	}
 	/* compute the leaf certificate hash */
-	ctx = EVP_MD_CTX_new();
-	if (!EVP_DigestInit(ctx, md)) {
-		EVP_MD_CTX_free(ctx);
+	ctx = md_ctx_get(md);
+	if (!ctx) {
 		printf("Unable to set up the digest context\n");
 		goto out;
 	}
@@ -1893,7 +2594,7 @@ static int verify_leaf_hash(X509 *leaf, const char *leafhash)
 	EVP_DigestUpdate(ctx, certbuf, certlen);
 	OPENSSL_free(certbuf);
 	EVP_DigestFinal(ctx, cmdbuf, NULL);
-	EVP_MD_CTX_free(ctx);
+	md_ctx_put(ctx);
 
 	/* compare the provided hash against the computed hash */
 	if (memcmp(mdbuf, cmdbuf, (size_t)EVP_MD_size(md))) {
@@ -2161,6 +2862,216 @@ static int set_store_time(X509_STORE *store, time_t time)
 	return 1; /* OK */
 }
 
+/*
+ * Cache of loaded certificate stores, keyed by the source file names.
+ * Parsing a large CA bundle or CRL file dominates verification latency,
+ * so each configuration is parsed once per process and handed out as a
+ * new reference; the files are only re-read when their modification
+ * times change. Callers free their reference as usual.
+ */
+typedef struct {
+	char *certs;
+	char *crl;
+	int crl_check;
+	time_t certs_mtime;
+	time_t crl_mtime;
+	X509_STORE *store;
+} STORE_CACHE_ENTRY;
+
+#define MAX_STORE_CACHE 8
+
+static STORE_CACHE_ENTRY store_cache[MAX_STORE_CACHE];
+
+static time_t get_file_mtime(const char *path)
+{
+	int ret;
+#ifdef _WIN32
+	struct _stat st;
+	ret = path ? _stat(path, &st) : 1;
+#else
+	struct stat st;
+	ret = path ? stat(path, &st) : 1;
+#endif
+	if (ret)
+		return 0;
+	return st.st_mtime;
+}
+
+static void store_cache_entry_free(STORE_CACHE_ENTRY *entry)
+{
+	OPENSSL_free(entry->certs);
+	OPENSSL_free(entry->crl);
+	X509_STORE_free(entry->store);
+	memset(entry, 0, sizeof(STORE_CACHE_ENTRY));
+}
+
+static void store_cache_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_STORE_CACHE; i++)
+		store_cache_entry_free(&store_cache[i]);
+}
+
+static X509_STORE *store_cache_get(char *certs, char *crl, int crl_check)
+{
+	STORE_CACHE_ENTRY *entry = NULL, *unused = NULL;
+	X509_STORE *store;
+	X509_VERIFY_PARAM *param;
+	int i;
+
+	if (!certs)
+		return NULL; /* FAILED */
+	for (i = 0; i < MAX_STORE_CACHE; i++) {
+		if (!store_cache[i].store) {
+			if (!unused)
+				unused = &store_cache[i];
+		} else if (!strcmp(store_cache[i].certs, certs)
+				&& store_cache[i].crl_check == crl_check
+				&& !store_cache[i].crl == !crl
+				&& (!crl || !strcmp(store_cache[i].crl, crl))) {
+			entry = &store_cache[i];
+			break;
+		}
+	}
+	if (entry && (entry->certs_mtime != get_file_mtime(certs)
+			|| entry->crl_mtime != get_file_mtime(crl))) {
+		/* the source files have changed, drop the parsed store */
+		store_cache_entry_free(entry);
+		unused = entry;
+		entry = NULL;
+	}
+	if (!entry) {
+		if (!unused) {
+			/* every slot holds another configuration, evict the first one */
+			unused = &store_cache[0];
+			store_cache_entry_free(unused);
+		}
+		store = X509_STORE_new();
+		if (!store)
+			return NULL; /* FAILED */
+		if (!(crl_check ? load_crlfile_lookup(store, certs, crl)
+				: load_file_lookup(store, certs))) {
+			X509_STORE_free(store);
+			return NULL; /* FAILED */
+		}
+		entry = unused;
+		entry->certs = OPENSSL_strdup(certs);
+		entry->crl = crl ? OPENSSL_strdup(crl) : NULL;
+		entry->crl_check = crl_check;
+		entry->certs_mtime = get_file_mtime(certs);
+		entry->crl_mtime = get_file_mtime(crl);
+		entry->store = store;
+	}
+	/* reset any verification time a previous use may have set */
+	param = X509_STORE_get0_param(entry->store);
+	if (param) {
+		(void)X509_VERIFY_PARAM_clear_flags(param, X509_V_FLAG_USE_CHECK_TIME);
+		(void)X509_STORE_set1_param(entry->store, param);
+	}
+	if (!X509_STORE_up_ref(entry->store))
+		return NULL; /* FAILED */
+	return entry->store;
+}
+
+/*
+ * Cache of successful certificate chain validations.  A batch of files
+ * usually shares a handful of signer chains, so the X509_verify_cert()
+ * path building and the CRL checks are done once per chain, store
+ * configuration and verification day; later files with the same
+ * fingerprint only have their signature checked.  The store source file
+ * identities (path and mtime) are part of the fingerprint, so a changed
+ * CA bundle or CRL file invalidates the cached verdicts the same way it
+ * refreshes the parsed store above.  Only successful validations are
+ * cached: a failure re-runs the full path, so its error report is
+ * printed for every affected file.
+ */
+#define MAX_CHAIN_CACHE 32
+#define CHAIN_FPR_SIZE 32
+#define CHAIN_CACHE_TIME_BUCKET 86400
+
+static struct {
+	u_char fingerprint[CHAIN_FPR_SIZE];
+	int used;
+} chain_cache[MAX_CHAIN_CACHE];
+static int chain_cache_next;
+
+static void chain_cache_hash_cert(EVP_MD_CTX *mdctx, X509 *cert)
+{
+	u_char *der = NULL;
+	int len = i2d_X509(cert, &der);
+
+	if (len > 0)
+		EVP_DigestUpdate(mdctx, der, (size_t)len);
+	OPENSSL_free(der);
+}
+
+/*
+ * Fingerprint one chain validation: the store configuration and the
+ * mtimes of its source files, the signer and chain certificates, any
+ * embedded CRLs and the verification time rounded to a day
+ */
+static int chain_cache_fingerprint(const char *kind, char *certs, char *crl,
+		X509 *signer, STACK_OF(X509) *chain, STACK_OF(X509_CRL) *crls,
+		time_t vtime, u_char *fingerprint)
+{
+	EVP_MD_CTX *mdctx;
+	char buf[64];
+	int i;
+
+	if (!certs)
+		return 0; /* FAILED */
+	mdctx = md_ctx_get(md_by_nid(NID_sha256));
+	if (!mdctx)
+		return 0; /* FAILED */
+	if (vtime == INVALID_TIME)
+		vtime = time(NULL);
+	EVP_DigestUpdate(mdctx, kind, strlen(kind) + 1);
+	EVP_DigestUpdate(mdctx, certs, strlen(certs) + 1);
+	if (crl)
+		EVP_DigestUpdate(mdctx, crl, strlen(crl) + 1);
+	BIO_snprintf(buf, sizeof buf, "%lld|%lld|%lld",
+		(long long)get_file_mtime(certs), (long long)get_file_mtime(crl),
+		(long long)(vtime / CHAIN_CACHE_TIME_BUCKET));
+	EVP_DigestUpdate(mdctx, buf, strlen(buf) + 1);
+	if (signer)
+		chain_cache_hash_cert(mdctx, signer);
+	for (i = 0; i < sk_X509_num(chain); i++)
+		chain_cache_hash_cert(mdctx, sk_X509_value(chain, i));
+	for (i = 0; i < sk_X509_CRL_num(crls); i++) {
+		u_char *der = NULL;
+		int len = i2d_X509_CRL(sk_X509_CRL_value(crls, i), &der);
+
+		if (len > 0)
+			EVP_DigestUpdate(mdctx, der, (size_t)len);
+		OPENSSL_free(der);
+	}
+	EVP_DigestFinal_ex(mdctx, fingerprint, NULL);
+	md_ctx_put(mdctx);
+	return 1; /* OK */
+}
+
+static int chain_cache_find(const u_char *fingerprint)
+{
+	int i;
+
+	for (i = 0; i < MAX_CHAIN_CACHE; i++) {
+		if (chain_cache[i].used && !memcmp(chain_cache[i].fingerprint,
+				fingerprint, CHAIN_FPR_SIZE))
+			return 1;
+	}
+	return 0;
+}
+
+static void chain_cache_add(const u_char *fingerprint)
+{
+	if (chain_cache_find(fingerprint))
+		return;
+	memcpy(chain_cache[chain_cache_next].fingerprint, fingerprint, CHAIN_FPR_SIZE);
+	chain_cache[chain_cache_next].used = 1;
+	chain_cache_next = (chain_cache_next + 1) % MAX_CHAIN_CACHE;
+}
+
 static int cms_print_timestamp(CMS_ContentInfo *cms, time_t time)
 {
 	STACK_OF(CMS_SignerInfo) *sinfos;
@@ -2392,10 +3303,10 @@ static void signature_free(SIGNATURE *signature)
 	OPENSSL_free(signature);
 }
 
-static int append_signature_list(STACK_OF(SIGNATURE) **signatures, PKCS7 *p7, int allownest);
+static int append_signature_list(STACK_OF(SIGNATURE) *signatures, PKCS7 *p7, int allownest, int pos);
 
-static void get_unsigned_attributes(STACK_OF(SIGNATURE) **signatures, SIGNATURE *signature,
-		STACK_OF(X509_ATTRIBUTE) *unauth_attr, PKCS7 *p7, int allownest)
+static void get_unsigned_attributes(STACK_OF(SIGNATURE) *signatures, SIGNATURE *signature,
+		STACK_OF(X509_ATTRIBUTE) *unauth_attr, PKCS7 *p7, int allownest, int pos)
 {
 	X509_ATTRIBUTE *attr;
 	ASN1_OBJECT *object;
@@ -2472,7 +3383,7 @@ static void get_unsigned_attributes(STACK_OF(SIGNATURE) **signatures, SIGNATURE
 				data = ASN1_STRING_get0_data(value);
 				nested = d2i_PKCS7(NULL, &data, ASN1_STRING_length(value));
 				if (nested)
-					if (!append_signature_list(signatures, nested, 0)) {
+					if (!append_signature_list(signatures, nested, 0, pos + 1)) {
 						printf("Failed to append signature list\n\n");
 						PKCS7_free(nested);
 					}
@@ -2485,11 +3396,10 @@ static void get_unsigned_attributes(STACK_OF(SIGNATURE) **signatures, SIGNATURE
 	}
 }
 
-static int append_signature_list(STACK_OF(SIGNATURE) **signatures, PKCS7 *p7, int allownest)
+static int append_signature_list(STACK_OF(SIGNATURE) *signatures, PKCS7 *p7, int allownest, int pos)
 {
 	SIGNATURE *signature = NULL;
 	PKCS7_SIGNER_INFO *si;
-	STACK_OF(X509_ATTRIBUTE) *auth_attr, *unauth_attr;
 	STACK_OF(PKCS7_SIGNER_INFO) *signer_info = PKCS7_get_signer_info(p7);
 
 	if (!signer_info)
@@ -2510,16 +3420,11 @@ static int append_signature_list(STACK_OF(SIGNATURE) **signatures, PKCS7 *p7, in
 	signature->timestamp = NULL;
 	signature->time = INVALID_TIME;
 	signature->blob = NULL;
+	signature->si = si;
+	signature->allownest = allownest;
+	signature->decoded = 0;
 
-	auth_attr = PKCS7_get_signed_attributes(si);  /* cont[0] */
-	if (auth_attr)
-		get_signed_attributes(signature, auth_attr);
-
-	unauth_attr = PKCS7_get_attributes(si); /* cont[1] */
-	if (unauth_attr)
-		get_unsigned_attributes(signatures, signature, unauth_attr, p7, allownest);
-
-	if (!sk_SIGNATURE_unshift(*signatures, signature)) {
+	if (!sk_SIGNATURE_insert(signatures, signature, pos)) {
 		printf("Failed to insert signature\n");
 		signature_free(signature);
 		return 0; /* FAILED */
@@ -2527,6 +3432,39 @@ static int append_signature_list(STACK_OF(SIGNATURE) **signatures, PKCS7 *p7, in
 	return 1; /* OK */
 }
 
+/*
+ * Decode the signed and unsigned attributes of a signature on first
+ * access.  Nested signatures found among the unsigned attributes are
+ * inserted into the stack right after their carrier, which yields the
+ * same stack order as the former eager decoding.
+ */
+static void signature_decode(STACK_OF(SIGNATURE) *signatures, SIGNATURE *signature, int pos)
+{
+	STACK_OF(X509_ATTRIBUTE) *auth_attr, *unauth_attr;
+
+	if (signature->decoded)
+		return;
+	signature->decoded = 1;
+
+	auth_attr = PKCS7_get_signed_attributes(signature->si);  /* cont[0] */
+	if (auth_attr)
+		get_signed_attributes(signature, auth_attr);
+
+	unauth_attr = PKCS7_get_attributes(signature->si); /* cont[1] */
+	if (unauth_attr)
+		get_unsigned_attributes(signatures, signature, unauth_attr,
+			signature->p7, signature->allownest, pos);
+}
+
+static void signature_list_decode(STACK_OF(SIGNATURE) *signatures)
+{
+	int i;
+
+	/* decoding may insert nested signatures, so re-read the count */
+	for (i = 0; i < sk_SIGNATURE_num(signatures); i++)
+		signature_decode(signatures, sk_SIGNATURE_value(signatures, i), i);
+}
+
 /*
  * compare the hash provided from the TSTInfo object against the hash computed
  * from the signature created by the signing certificate's private key
@@ -2548,16 +3486,15 @@ static int TST_verify(CMS_ContentInfo *timestamp, PKCS7_SIGNER_INFO *si)
 		if (token) {
 			/* compute a hash from the encrypted message digest value of the file */
 			md_nid = OBJ_obj2nid(token->messageImprint->digestAlgorithm->algorithm);
-			md = EVP_get_digestbynid(md_nid);
-			mdctx = EVP_MD_CTX_new();
-			if (!EVP_DigestInit(mdctx, md)) {
-				EVP_MD_CTX_free(mdctx);
+			md = md_by_nid(md_nid);
+			mdctx = md_ctx_get(md);
+			if (!mdctx) {
 				printf("Unable to set up the digest context\n");
 				return 0; /* FAILED */
 			}
 			EVP_DigestUpdate(mdctx, si->enc_digest->data, (size_t)si->enc_digest->length);
 			EVP_DigestFinal(mdctx, mdbuf, NULL);
-			EVP_MD_CTX_free(mdctx);
+			md_ctx_put(mdctx);
 
 			/* compare the provided hash against the computed hash */
 			hash = token->messageImprint->digest;
@@ -2688,11 +3625,9 @@ static int verify_crl(char *ca_file, char *crl_file, STACK_OF(X509_CRL) *crls,
 	ctx = X509_STORE_CTX_new();
 	if (!ctx)
 		goto out;
-	store = X509_STORE_new();
+	store = store_cache_get(ca_file, crl_file, 1);
 	if (!store)
 		goto out;
-	if (!load_crlfile_lookup(store, ca_file, crl_file))
-		goto out;
 
 	/* initialise an X509_STORE_CTX structure for subsequent use by X509_verify_cert()*/
 	if (!X509_STORE_CTX_init(ctx, store, signer, chain))
@@ -2729,12 +3664,20 @@ static int verify_timestamp(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 	STACK_OF(X509_CRL) *crls;
 	char *url;
 	PKCS7_SIGNER_INFO *si;
-	int verok = 0;
+	u_char fingerprint[CHAIN_FPR_SIZE];
+	int verok = 0, fprok, chain_cached = 0;
 
-	store = X509_STORE_new();
-	if (!store)
-		goto out;
-	if (load_file_lookup(store, options->tsa_cafile)) {
+	{
+		STACK_OF(X509) *certs = CMS_get1_certs(signature->timestamp);
+
+		fprok = chain_cache_fingerprint("timestamp", options->tsa_cafile,
+			options->tsa_crlfile, NULL, certs, signature->p7->d.sign->crl,
+			signature->time, fingerprint);
+		sk_X509_pop_free(certs, X509_free);
+		chain_cached = fprok && chain_cache_find(fingerprint);
+	}
+	store = store_cache_get(options->tsa_cafile, NULL, 0);
+	if (store) {
 		/*
 		 * The TSA signing key MUST be of a sufficient length to allow for a sufficiently
 		 * long lifetime.  Even if this is done, the key will  have a finite lifetime.
@@ -2755,8 +3698,10 @@ static int verify_timestamp(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 		goto out;
 	}
 
-	/* verify a CMS SignedData structure */
-	if (!CMS_verify(signature->timestamp, NULL, store, 0, NULL, 0)) {
+	/* verify a CMS SignedData structure; an already-validated chain
+	   fingerprint skips the certificate path building */
+	if (!CMS_verify(signature->timestamp, NULL, store, 0, NULL,
+			chain_cached ? CMS_NO_SIGNER_CERT_VERIFY : 0)) {
 		printf("\nCMS_verify error\n");
 		X509_STORE_free(store);
 		goto out;
@@ -2775,7 +3720,12 @@ static int verify_timestamp(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 
 	/* verify a Certificate Revocation List */
 	crls = signature->p7->d.sign->crl;
-	if (options->tsa_crlfile || crls) {
+	if (chain_cached) {
+		if (options->tsa_crlfile || crls)
+			printf("Timestamp Server Signature CRL verification: cached\n");
+		else
+			printf("\n");
+	} else if (options->tsa_crlfile || crls) {
 		STACK_OF(X509) *chain = CMS_get1_certs(signature->timestamp);
 		int crlok = verify_crl(options->tsa_cafile, options->tsa_crlfile, crls, signer, chain);
 		sk_X509_pop_free(chain, X509_free);
@@ -2801,6 +3751,8 @@ static int verify_timestamp(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 	if (!TST_verify(signature->timestamp, si))
 		goto out;
 
+	if (fprok)
+		chain_cache_add(fingerprint);
 	verok = 1; /* OK */
 out:
 	if (!verok)
@@ -2813,14 +3765,19 @@ static int verify_authenticode(SIGNATURE *signature, GLOBAL_OPTIONS *options, X5
 	X509_STORE *store;
 	STACK_OF(X509_CRL) *crls;
 	BIO *bio = NULL;
-	int verok = 0;
-
-	store = X509_STORE_new();
-	if (!store)
-		goto out;
-	if (!load_file_lookup(store, options->cafile)) {
+	u_char fingerprint[CHAIN_FPR_SIZE];
+	time_t verify_time;
+	int verok = 0, fprok, chain_cached;
+
+	verify_time = signature->time != INVALID_TIME ? signature->time : options->time;
+	fprok = chain_cache_fingerprint("authenticode", options->cafile,
+		options->crlfile, signer, signature->p7->d.sign->cert,
+		signature->p7->d.sign->crl, verify_time, fingerprint);
+	chain_cached = fprok && chain_cache_find(fingerprint);
+
+	store = store_cache_get(options->cafile, NULL, 0);
+	if (!store) {
 		printf("Failed to add store lookup file\n");
-		X509_STORE_free(store);
 		goto out;
 	}
 	if (signature->time != INVALID_TIME) {
@@ -2853,7 +3810,10 @@ static int verify_authenticode(SIGNATURE *signature, GLOBAL_OPTIONS *options, X5
 		bio = BIO_new_mem_buf(signature->p7->d.sign->contents->d.other->value.sequence->data,
 			signature->p7->d.sign->contents->d.other->value.sequence->length);
 	}
-	if (!PKCS7_verify(signature->p7, NULL, store, bio, NULL, 0)) {
+	/* an already-validated chain fingerprint skips the certificate
+	   path building; the signature itself is still checked */
+	if (!PKCS7_verify(signature->p7, NULL, store, bio, NULL,
+			chain_cached ? PKCS7_NOVERIFY : 0)) {
 		printf("\nPKCS7_verify error\n");
 		X509_STORE_free(store);
 		BIO_free(bio);
@@ -2865,11 +3825,15 @@ static int verify_authenticode(SIGNATURE *signature, GLOBAL_OPTIONS *options, X5
 	/* verify a Certificate Revocation List */
 	crls = signature->p7->d.sign->crl;
 	if (options->crlfile || crls) {
-		STACK_OF(X509) *chain = signature->p7->d.sign->cert;
-		int crlok = verify_crl(options->cafile, options->crlfile, crls, signer, chain);
-		printf("Signature CRL verification: %s\n", crlok ? "ok" : "failed");
-		if (!crlok)
-			goto out;
+		if (chain_cached) {
+			printf("Signature CRL verification: cached\n");
+		} else {
+			STACK_OF(X509) *chain = signature->p7->d.sign->cert;
+			int crlok = verify_crl(options->cafile, options->crlfile, crls, signer, chain);
+			printf("Signature CRL verification: %s\n", crlok ? "ok" : "failed");
+			if (!crlok)
+				goto out;
+		}
 	}
 
 	/* check extended key usage flag XKU_CODE_SIGN */
@@ -2878,6 +3842,8 @@ static int verify_authenticode(SIGNATURE *signature, GLOBAL_OPTIONS *options, X5
 		goto out;
 	}
 
+	if (fprok)
+		chain_cache_add(fingerprint);
 	verok = 1; /* OK */
 out:
 	if (!verok)
@@ -2943,6 +3909,111 @@ static int verify_signature(SIGNATURE *signature, GLOBAL_OPTIONS *options)
 	return 0; /* OK */
 }
 
+/*
+ * Run the per-signature verification callback over every entry of the
+ * signature stack and combine the results the same way as the sequential
+ * loop does.  With "-threads <n>" greater than one the signatures are
+ * verified by parallel worker processes: each worker report is piped back
+ * and printed in signature order, so the combined output matches a
+ * sequential run.  Worker processes are used instead of threads because
+ * the verification report is printed with stdio all the way down.
+ * With "-fast" the run stops at the first signature that verifies
+ * successfully; the remaining signatures keep their attributes and any
+ * nested signatures undecoded.  The trailing count line reports the
+ * number of signatures actually processed.
+ */
+static int verify_signatures(STACK_OF(SIGNATURE) *signatures,
+		int (*verify)(SIGNATURE *signature, void *ctx), void *ctx,
+		int index_lines, GLOBAL_OPTIONS *options)
+{
+	int i, ret = 1;
+	int num;
+
+	if (options->fast) {
+		for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
+			SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
+
+			signature_decode(signatures, signature, i);
+			if (index_lines)
+				printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
+			ret &= verify(signature, ctx);
+			if (!ret) {
+				printf("Number of verified signatures: %d\n", i + 1);
+				return 0; /* OK */
+			}
+		}
+		printf("Number of verified signatures: %d\n", sk_SIGNATURE_num(signatures));
+		return ret;
+	}
+	signature_list_decode(signatures);
+	num = sk_SIGNATURE_num(signatures);
+
+#ifndef WIN32
+	if (options->threads > 1 && num > 1) {
+		int *fds = OPENSSL_malloc((size_t)num * sizeof(int));
+		pid_t *pids = OPENSSL_malloc((size_t)num * sizeof(pid_t));
+		int launched = 0;
+
+		for (i = 0; i < num; i++) {
+			/* keep up to "-threads" workers ahead of the printed signature */
+			while (launched < num && launched < i + options->threads) {
+				SIGNATURE *signature = sk_SIGNATURE_value(signatures, launched);
+				int pipefd[2];
+				pid_t pid = -1;
+
+				if (!pipe(pipefd)) {
+					fflush(stdout);
+					pid = fork();
+					if (pid == 0) { /* worker process */
+						close(pipefd[0]);
+						dup2(pipefd[1], fileno(stdout));
+						close(pipefd[1]);
+						exit(verify(signature, ctx));
+					}
+					close(pipefd[1]);
+					if (pid < 0)
+						close(pipefd[0]);
+				}
+				fds[launched] = pid < 0 ? -1 : pipefd[0];
+				pids[launched] = pid;
+				launched++;
+			}
+			if (index_lines)
+				printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
+			if (pids[i] < 0) {
+				/* failed to start a worker, verify in the parent */
+				ret &= verify(sk_SIGNATURE_value(signatures, i), ctx);
+			} else {
+				char buf[4096];
+				ssize_t nread;
+				int status = 1;
+
+				while ((nread = read(fds[i], buf, sizeof buf)) > 0)
+					fwrite(buf, 1, (size_t)nread, stdout);
+				close(fds[i]);
+				if (waitpid(pids[i], &status, 0) == pids[i] && WIFEXITED(status))
+					ret &= WEXITSTATUS(status);
+				else
+					ret &= 1; /* FAILED */
+			}
+		}
+		OPENSSL_free(fds);
+		OPENSSL_free(pids);
+		printf("Number of verified signatures: %d\n", num);
+		return ret;
+	}
+#endif /* WIN32 */
+	for (i = 0; i < num; i++) {
+		SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
+
+		if (index_lines)
+			printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
+		ret &= verify(signature, ctx);
+	}
+	printf("Number of verified signatures: %d\n", num);
+	return ret;
+}
+
 /*
  * MSI file support
  * https://msdn.microsoft.com/en-us/library/dd942138.aspx
@@ -2971,12 +4042,14 @@ static int msi_verify_header(char *indata, uint32_t filesize, MSI_PARAMS *msipar
 }
 
 static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dirent,
-		char *exdata, int exlen, GLOBAL_OPTIONS *options)
+		char *exdata, int exlen, DIGEST_CACHE *cache, DIGEST_CACHE *precache,
+		GLOBAL_OPTIONS *options)
 {
 	int ret = 1, mdok, mdtype = -1;
 	u_char mdbuf[EVP_MAX_MD_SIZE];
 	u_char cmdbuf[EVP_MAX_MD_SIZE];
 	u_char cexmdbuf[EVP_MAX_MD_SIZE];
+	u_char *digest;
 	const EVP_MD *md;
 	BIO *hash;
 
@@ -2997,7 +4070,24 @@ static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dir
 		goto out;
 	}
 	printf("Message digest algorithm         : %s\n", OBJ_nid2sn(mdtype));
-	md = EVP_get_digestbynid(mdtype);
+	md = md_by_nid(mdtype);
+	/* reuse digests already computed with this algorithm for another signature */
+	digest = cache ? digest_cache_get(cache, mdtype) : NULL;
+	if (digest && exdata && !digest_cache_get(precache, mdtype))
+		digest = NULL; /* the pre-hash is also needed */
+	if (digest) {
+		if (exdata) {
+			if (EVP_MD_size(md) != exlen) {
+				printf("Incorrect MsiDigitalSignatureEx stream data length\n\n");
+				goto out;
+			}
+			memcpy(cexmdbuf, digest_cache_get(precache, mdtype), sizeof cexmdbuf);
+			print_hash("Current MsiDigitalSignatureEx    ", "", (u_char *)exdata, exlen);
+			print_hash("Calculated MsiDigitalSignatureEx ", "", cexmdbuf, EVP_MD_size(md));
+		}
+		memcpy(cmdbuf, digest, sizeof cmdbuf);
+		goto compare;
+	}
 	hash = BIO_new(BIO_f_md());
 	if (!BIO_set_md(hash, md)) {
 		printf("Unable to set the message digest of BIO\n");
@@ -3028,10 +4118,13 @@ static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dir
 			BIO_free_all(prehash);
 			goto out;
 		}
+		memset(cexmdbuf, 0, EVP_MAX_MD_SIZE);
 		BIO_gets(prehash, (char*)cexmdbuf, EVP_MAX_MD_SIZE);
 		BIO_free_all(prehash);
 		BIO_write(hash, (char*)cexmdbuf, EVP_MD_size(md));
 		print_hash("Calculated MsiDigitalSignatureEx ", "", cexmdbuf, EVP_MD_size(md));
+		if (precache)
+			digest_cache_put(precache, mdtype, cexmdbuf);
 	}
 
 	if (!msi_hash_dir(msi, dirent, hash, 1)) {
@@ -3039,9 +4132,13 @@ static int msi_verify_pkcs7(SIGNATURE *signature, MSI_FILE *msi, MSI_DIRENT *dir
 		BIO_free_all(hash);
 		goto out;
 	}
-	print_hash("Current DigitalSignature         ", "", mdbuf, EVP_MD_size(md));
+	memset(cmdbuf, 0, EVP_MAX_MD_SIZE);
 	BIO_gets(hash, (char*)cmdbuf, EVP_MAX_MD_SIZE);
 	BIO_free_all(hash);
+	if (cache)
+		digest_cache_put(cache, mdtype, cmdbuf);
+compare:
+	print_hash("Current DigitalSignature         ", "", mdbuf, EVP_MD_size(md));
 	mdok = !memcmp(mdbuf, cmdbuf, (size_t)EVP_MD_size(md));
 	print_hash("Calculated DigitalSignature      ", mdok ? "\n" : "    MISMATCH!!!\n", cmdbuf, EVP_MD_size(md));
 	if (!mdok) {
@@ -3055,19 +4152,40 @@ out:
 	return ret;
 }
 
+typedef struct {
+	MSI_PARAMS *msiparams;
+	char *exdata;
+	int exlen;
+	DIGEST_CACHE *cache;
+	DIGEST_CACHE *precache;
+	GLOBAL_OPTIONS *options;
+} MSI_VERIFY_CTX;
+
+static int msi_verify_signature(SIGNATURE *signature, void *arg)
+{
+	MSI_VERIFY_CTX *ctx = arg;
+
+	return msi_verify_pkcs7(signature, ctx->msiparams->msi, ctx->msiparams->dirent,
+		ctx->exdata, ctx->exlen, ctx->cache, ctx->precache, ctx->options);
+}
+
 static int msi_verify_file(MSI_PARAMS *msiparams, GLOBAL_OPTIONS *options)
 {
-	int i, ret = 1;
+	int ret = 1;
 	char *indata = NULL;
 	char *exdata = NULL;
 	const u_char *blob;
 	uint32_t inlen, exlen = 0;
 	PKCS7 *p7;
 
+	DIGEST_CACHE cache, precache;
 	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
 	MSI_ENTRY *dse = NULL;
 	MSI_ENTRY *ds = msi_signatures_get(msiparams->dirent, &dse);
 
+	cache.count = 0;
+	precache.count = 0;
+
 	if (!ds) {
 		printf("MSI file has no signature\n\n");
 		goto out;
@@ -3094,17 +4212,22 @@ static int msi_verify_file(MSI_PARAMS *msiparams, GLOBAL_OPTIONS *options)
 		printf("Failed to extract PKCS7 data\n\n");
 		goto out;
 	}
-	if (!append_signature_list(&signatures, p7, 1)) {
+	if (!append_signature_list(signatures, p7, 1, 0)) {
 		printf("Failed to create signature list\n\n");
 		PKCS7_free(p7);
 		goto out;
 	}
-	for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
-		SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
-		printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
-		ret &= msi_verify_pkcs7(signature, msiparams->msi, msiparams->dirent, exdata, (int)exlen, options);
+	{
+		MSI_VERIFY_CTX ctx;
+
+		ctx.msiparams = msiparams;
+		ctx.exdata = exdata;
+		ctx.exlen = (int)exlen;
+		ctx.cache = &cache;
+		ctx.precache = &precache;
+		ctx.options = options;
+		ret &= verify_signatures(signatures, msi_verify_signature, &ctx, 1, options);
 	}
-	printf("Number of verified signatures: %d\n", i);
 out:
 	sk_SIGNATURE_pop_free(signatures, signature_free);
 	OPENSSL_free(indata);
@@ -3241,50 +4364,106 @@ static int msi_calc_MsiDigitalSignatureEx(MSI_PARAMS *msiparams, const EVP_MD *m
  * PE file support
  */
 
-/* Compute a message digest value of the signed or unsigned PE file */
-static int pe_calc_digest(char *indata, int mdtype, u_char *mdbuf, FILE_HEADER *header)
+/* Compute digests with all requested algorithms in one pass over the PE file */
+/*
+ * Drop already-consumed pages of the mapped input file, so the peak
+ * resident memory of a sequential pass stays bounded by the processing
+ * window regardless of the input size.  The pages are clean and
+ * read-only, any later access simply faults them back in from the file.
+ */
+static void unmap_consumed(char *indata, size_t begin, size_t end)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_DONTNEED)
+	size_t pagemask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+
+	begin = (begin + pagemask) & ~pagemask;
+	end &= ~pagemask;
+	if (end > begin)
+		madvise(indata + begin, end - begin, MADV_DONTNEED);
+#else
+	(void)indata;
+	(void)begin;
+	(void)end;
+#endif /* HAVE_SYS_MMAN_H && MADV_DONTNEED */
+}
+
+/*
+ * Hint that the mapped file will be accessed sparsely, so the kernel does
+ * not read ahead around the few pages that are actually touched.  Used for
+ * commands that only need the file header and the signature blob.
+ */
+static void advise_random_access(char *indata, size_t size)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_RANDOM)
+	madvise(indata, size, MADV_RANDOM);
+#else
+	(void)indata;
+	(void)size;
+#endif /* HAVE_SYS_MMAN_H && MADV_RANDOM */
+}
+
+/*
+ * Hint that the mapped file is about to be streamed front to back, so
+ * the kernel grows its readahead window instead of waiting for the
+ * fault pattern to look sequential.  On a cold cache this keeps the
+ * digest passes running at device streaming speed.
+ */
+static void advise_sequential(char *indata, size_t size)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MADV_SEQUENTIAL)
+	madvise(indata, size, MADV_SEQUENTIAL);
+#else
+	(void)indata;
+	(void)size;
+#endif /* HAVE_SYS_MMAN_H && MADV_SEQUENTIAL */
+}
+
+static int pe_calc_digests(char *indata, const int *mdtypes, int count,
+			DIGEST_CACHE *cache, FILE_HEADER *header)
 {
 	BIO *bio = NULL;
 	u_char *bfb;
-	EVP_MD_CTX *mdctx;
-	uint32_t n, offset;
+	EVP_MD_CTX *mdctx[MAX_DIGEST_CACHE];
+	uint32_t n, offset, released;
 	int ret = 0;
-	const EVP_MD *md = EVP_get_digestbynid(mdtype);
 
+	if (count <= 0 || count > MAX_DIGEST_CACHE)
+		return 0; /* FAILED */
+	if (!digests_init(mdctx, mdtypes, count))
+		goto err;
 	if (header->sigpos)
 		offset = header->sigpos;
 	else
 		offset = header->fileend;
+	advise_sequential(indata, offset);
 
-	mdctx = EVP_MD_CTX_new();
-	if (!EVP_DigestInit(mdctx, md)) {
-		printf("Unable to set up the digest context\n");
-		goto err;
-	}
-	memset(mdbuf, 0, EVP_MAX_MD_SIZE);
 	bio = BIO_new_mem_buf(indata, (int)offset);
 	(void)BIO_seek(bio, 0);
 
 	bfb = OPENSSL_malloc(SIZE_16M);
 
 	BIO_read(bio, bfb, (int)header->header_size + 88);
-	EVP_DigestUpdate(mdctx, bfb, header->header_size + 88);
+	digests_update(mdctx, count, bfb, header->header_size + 88);
 	BIO_read(bio, bfb, 4);
 	BIO_read(bio, bfb, 60 + (int)header->pe32plus * 16);
-	EVP_DigestUpdate(mdctx, bfb, 60 + header->pe32plus * 16);
+	digests_update(mdctx, count, bfb, 60 + header->pe32plus * 16);
 	BIO_read(bio, bfb, 8);
 
 	n = header->header_size + 88 + 4 + 60 + header->pe32plus * 16 + 8;
+	released = n;
 	while (n < offset) {
 		int l;
 		uint32_t want = offset - n;
-		if (want > sizeof bfb)
-			want = sizeof bfb;
+		if (want > SIZE_16M)
+			want = SIZE_16M;
 		l = BIO_read(bio, bfb, (int)want);
 		if (l <= 0)
 			break;
-		EVP_DigestUpdate(mdctx, bfb, (size_t)l);
+		digests_update(mdctx, count, bfb, (size_t)l);
 		n += (uint32_t)l;
+		/* keep the resident window bounded for large files */
+		unmap_consumed(indata, released, n);
+		released = n;
 	}
 
 	if (!header->sigpos) {
@@ -3292,24 +4471,35 @@ static int pe_calc_digest(char *indata, int mdtype, u_char *mdbuf, FILE_HEADER *
 		int len = 8 - header->fileend % 8;
 		if (len > 0 && len != 8) {
 			memset(bfb, 0, (size_t)len);
-			EVP_DigestUpdate(mdctx, bfb, (size_t)len);
+			digests_update(mdctx, count, bfb, (size_t)len);
 		}
 	}
 	OPENSSL_free(bfb);
-	BIO_free(bio);
-	EVP_DigestFinal(mdctx, mdbuf, NULL);
+	digests_final(mdctx, mdtypes, count, cache);
 	ret = 1; /* OK */
 err:
-	EVP_MD_CTX_free(mdctx);
+	digests_free(mdctx, count);
+	BIO_free(bio);
 	return ret;
 }
 
-static int pe_extract_page_hash(SpcAttributeTypeAndOptionalValue *obj,
-	u_char **ph, int *phlen, int *phtype)
+static int pe_calc_digest(char *indata, int mdtype, u_char *mdbuf, FILE_HEADER *header)
 {
-	const u_char *blob;
-	SpcPeImageData *id;
-	SpcSerializedObject *so;
+	DIGEST_CACHE cache;
+
+	cache.count = 0;
+	if (!pe_calc_digests(indata, &mdtype, 1, &cache, header))
+		return 0; /* FAILED */
+	memcpy(mdbuf, digest_cache_get(&cache, mdtype), EVP_MAX_MD_SIZE);
+	return 1; /* OK */
+}
+
+static int pe_extract_page_hash(SpcAttributeTypeAndOptionalValue *obj,
+	u_char **ph, int *phlen, int *phtype)
+{
+	const u_char *blob;
+	SpcPeImageData *id;
+	SpcSerializedObject *so;
 	int l, l2;
 	char buf[128];
 
@@ -3366,14 +4556,14 @@ static int pe_extract_page_hash(SpcAttributeTypeAndOptionalValue *obj,
 	return 1; /* OK */
 }
 
-static int pe_page_hash(char *indata, FILE_HEADER *header, u_char *ph, int phlen, int phtype)
+static int pe_page_hash(char *indata, FILE_HEADER *header, u_char *ph, int phlen, int phtype, int nthreads)
 {
 	int mdok, cphlen = 0;
 	u_char *cph;
 
 	printf("Page hash algorithm  : %s\n", OBJ_nid2sn(phtype));
 	print_hash("Page hash            ", "...", ph, (phlen < 32) ? phlen : 32);
-	cph = pe_calc_page_hash(indata, header->header_size, header->pe32plus, header->sigpos, phtype, &cphlen);
+	cph = pe_calc_page_hash(indata, header->header_size, header->pe32plus, header->sigpos, phtype, nthreads, &cphlen);
 	mdok = (phlen == cphlen) && !memcmp(ph, cph, (size_t)phlen);
 	print_hash("Calculated page hash ", mdok ? "...\n" : "... MISMATCH!!!\n", cph, (cphlen < 32) ? cphlen : 32);
 	OPENSSL_free(cph);
@@ -3381,8 +4571,9 @@ static int pe_page_hash(char *indata, FILE_HEADER *header, u_char *ph, int phlen
 }
 
 static int pe_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *header,
-			GLOBAL_OPTIONS *options)
+			DIGEST_CACHE *cache, GLOBAL_OPTIONS *options)
 {
+	u_char *digest;
 	int ret = 1, mdtype = -1, phtype = -1;
 	u_char mdbuf[EVP_MAX_MD_SIZE];
 	u_char cmdbuf[EVP_MAX_MD_SIZE];
@@ -3410,7 +4601,10 @@ static int pe_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *head
 		printf("Failed to extract current message digest\n\n");
 		goto out;
 	}
-	if (!pe_calc_digest(indata, mdtype, cmdbuf, header)) {
+	digest = cache ? digest_cache_get(cache, mdtype) : NULL;
+	if (digest) {
+		memcpy(cmdbuf, digest, sizeof cmdbuf);
+	} else if (!pe_calc_digest(indata, mdtype, cmdbuf, header)) {
 		printf("Failed to calculate message digest\n\n");
 		goto out;
 	}
@@ -3418,7 +4612,7 @@ static int pe_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *head
 		printf("Signature verification: failed\n\n");
 		goto out;
 	}
-	if (phlen > 0 && !pe_page_hash(indata, header, ph, phlen, phtype)) {
+	if (phlen > 0 && !pe_page_hash(indata, header, ph, phlen, phtype, options->threads)) {
 		printf("Signature verification: failed\n\n");
 		goto out;
 	}
@@ -3455,22 +4649,37 @@ static PKCS7 *pe_extract_existing_pkcs7(char *indata, FILE_HEADER *header)
 	return p7;
 }
 
+typedef struct {
+	char *indata;
+	FILE_HEADER *header;
+	DIGEST_CACHE *cache;
+	GLOBAL_OPTIONS *options;
+} PE_VERIFY_CTX;
+
+static int pe_verify_signature(SIGNATURE *signature, void *arg)
+{
+	PE_VERIFY_CTX *ctx = arg;
+
+	return pe_verify_pkcs7(signature, ctx->indata, ctx->header, ctx->cache, ctx->options);
+}
+
 static int pe_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *options)
 {
-	int i, peok = 1, ret = 1;
-	BIO *bio;
+	int peok = 1, ret = 1;
+	int mdtypes[MAX_DIGEST_CACHE], nmdtypes;
 	uint32_t real_pe_checksum;
 	PKCS7 *p7;
+	DIGEST_CACHE cache;
 	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
 
+	cache.count = 0;
+
 	if (header->siglen == 0)
 		header->sigpos = header->fileend;
 
 	/* check PE checksum */
 	printf("Current PE checksum   : %08X\n", header->pe_checksum);
-	bio = BIO_new_mem_buf(indata, (int)header->fileend);
-	real_pe_checksum = pe_calc_checksum(bio, header);
-	BIO_free(bio);
+	real_pe_checksum = pe_calc_checksum_buf(indata, header->fileend, header);
 	if (header->pe_checksum && header->pe_checksum != real_pe_checksum)
 		peok = 0;
 	printf("Calculated PE checksum: %08X%s\n\n", real_pe_checksum, peok ? "" : "    MISMATCH!!!");
@@ -3488,17 +4697,28 @@ static int pe_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *opt
 		printf("Failed to extract PKCS7 data\n\n");
 		goto out;
 	}
-	if (!append_signature_list(&signatures, p7, 1)) {
+	if (!append_signature_list(signatures, p7, 1, 0)) {
 		printf("Failed to create signature list\n\n");
 		PKCS7_free(p7);
 		goto out;
 	}
-	for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
-		SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
-		printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
-		ret &= pe_verify_pkcs7(signature, indata, header, options);
+	/* compute the digests of all signatures in a single pass over the file */
+	if (!options->fast) {
+		signature_list_decode(signatures);
+		nmdtypes = signatures_get_mdtypes(signatures, mdtypes);
+		if (nmdtypes > 0 && !pe_calc_digests(indata, mdtypes, nmdtypes, &cache, header)) {
+			cache.count = 0; /* fall back to a per-signature pass */
+		}
+	}
+	{
+		PE_VERIFY_CTX ctx;
+
+		ctx.indata = indata;
+		ctx.header = header;
+		ctx.cache = &cache;
+		ctx.options = options;
+		ret &= verify_signatures(signatures, pe_verify_signature, &ctx, 1, options);
 	}
-	printf("Number of verified signatures: %d\n", i);
 out:
 	sk_SIGNATURE_pop_free(signatures, signature_free);
 	return ret;
@@ -3588,6 +4808,7 @@ static int pe_verify_header(char *indata, char *infile, uint32_t filesize, FILE_
 static void pe_modify_header(char *indata, FILE_HEADER *header, BIO *hash, BIO *outdata)
 {
 	int len = 0, i;
+	uint32_t idx, released;
 	char *buf = OPENSSL_malloc(SIZE_64K);
 
 	i = (int)header->header_size + 88;
@@ -3600,7 +4821,18 @@ static void pe_modify_header(char *indata, FILE_HEADER *header, BIO *hash, BIO *
 	memset(buf, 0, 8);
 	BIO_write(outdata, buf, 8); /* zero out sigtable offset + pos */
 	i += 8;
-	BIO_write(hash, indata + i, (int)header->fileend - i);
+	/* copy the rest of the file in bounded windows, releasing the pages
+	 * that have been consumed to keep the resident memory low */
+	idx = released = (uint32_t)i;
+	while (idx < header->fileend) {
+		uint32_t want = header->fileend - idx;
+		if (want > SIZE_16M)
+			want = SIZE_16M;
+		BIO_write(hash, indata + idx, (int)want);
+		idx += want;
+		unmap_consumed(indata, released, idx);
+		released = idx;
+	}
 
 	/* pad (with 0's) pe file to 8 byte boundary */
 	len = 8 - header->fileend % 8;
@@ -3681,153 +4913,161 @@ static int cab_verify_header(char *indata, char *infile, uint32_t filesize, FILE
 	return 1; /* OK */
 }
 
-/* Compute a message digest value of the signed or unsigned CAB file */
-static int cab_calc_digest(char *indata, int mdtype, u_char *mdbuf, FILE_HEADER *header)
-{
-	BIO *bio;
-	u_char *bfb;
-	EVP_MD_CTX *mdctx;
-	uint32_t offset, coffFiles;
-	int ret = 0;
-	const EVP_MD *md = EVP_get_digestbynid(mdtype);
+/*
+ * Hash-range extents of a CAB file.  The header structures are parsed once
+ * into a short span list, then every span is fed to the digest contexts
+ * directly from the mapped buffer, so the bulk of the file is hashed in
+ * large updates without staging copies.
+ */
+typedef struct {
+	uint32_t begin;
+	uint32_t end;
+} CAB_SPAN;
 
-	if (header->sigpos)
-		offset = header->sigpos;
-	else
-		offset = header->fileend;
+#define MAX_CAB_SPAN 4
 
-	mdctx = EVP_MD_CTX_new();
-	if (!EVP_DigestInit(mdctx, md)) {
-		printf("Unable to set up the digest context\n");
-		goto err;
+static int cab_add_span(CAB_SPAN *spans, int *nspans, uint32_t begin, uint32_t end)
+{
+	if (begin >= end)
+		return 1; /* OK, empty extent */
+	if (*nspans > 0 && spans[*nspans - 1].end == begin) {
+		/* merge adjacent extents */
+		spans[*nspans - 1].end = end;
+		return 1; /* OK */
 	}
-	bio = BIO_new_mem_buf(indata, (int)offset);
-	memset(mdbuf, 0, EVP_MAX_MD_SIZE);
-	(void)BIO_seek(bio, 0);
-
-	bfb = OPENSSL_malloc(SIZE_16M);
+	if (*nspans >= MAX_CAB_SPAN)
+		return 0; /* FAILED */
+	spans[*nspans].begin = begin;
+	spans[(*nspans)++].end = end;
+	return 1; /* OK */
+}
 
+/* One pass over the CFHEADER/CFFOLDER structures producing hash-range extents */
+static int cab_calc_spans(char *indata, FILE_HEADER *header, uint32_t offset,
+			CAB_SPAN *spans, int *nspans)
+{
+	*nspans = 0;
 	/* u1 signature[4] 4643534D MSCF: 0-3 */
-	BIO_read(bio, bfb, 4);
-	EVP_DigestUpdate(mdctx, bfb, 4);
-	/* u4 reserved1 00000000: 4-7 */
-	BIO_read(bio, bfb, 4);
+	if (!cab_add_span(spans, nspans, 0, 4))
+		return 0; /* FAILED */
+	/* u4 reserved1 00000000: 4-7 is excluded */
 	if (header->sigpos) {
 		uint16_t nfolders, flags;
-		uint32_t pos = 60;
+		uint32_t pos;
+
+		if (offset < 60)
+			return 0; /* FAILED */
 		/*
 		 * u4 cbCabinet - size of this cabinet file in bytes: 8-11
 		 * u4 reserved2 00000000: 12-15
-		 */
-		BIO_read(bio, bfb, 8);
-		EVP_DigestUpdate(mdctx, bfb, 8);
-		 /* u4 coffFiles - offset of the first CFFILE entry: 16-19 */
-		BIO_read(bio, bfb, 4);
-		coffFiles = GET_UINT32_LE(bfb);
-		EVP_DigestUpdate(mdctx, bfb, 4);
-		/*
+		 * u4 coffFiles - offset of the first CFFILE entry: 16-19
 		 * u4 reserved3 00000000: 20-23
 		 * u1 versionMinor 03: 24
 		 * u1 versionMajor 01: 25
+		 * u2 cFolders - number of CFFOLDER entries in this cabinet: 26-27
+		 * u2 cFiles - number of CFFILE entries in this cabinet: 28-29
+		 * u2 flags: 30-31
+		 * u2 setID must be the same for all cabinets in a set: 32-33
 		 */
-		BIO_read(bio, bfb, 6);
-		EVP_DigestUpdate(mdctx, bfb, 6);
-		/* u2 cFolders - number of CFFOLDER entries in this cabinet: 26-27 */
-		BIO_read(bio, bfb, 2);
-		nfolders = GET_UINT16_LE(bfb);
-		EVP_DigestUpdate(mdctx, bfb, 2);
-		/* u2 cFiles - number of CFFILE entries in this cabinet: 28-29 */
-		BIO_read(bio, bfb, 2);
-		EVP_DigestUpdate(mdctx, bfb, 2);
-		/* u2 flags: 30-31 */
-		BIO_read(bio, bfb, 2);
-		flags = GET_UINT16_LE(bfb);
-		EVP_DigestUpdate(mdctx, bfb, 2);
-		/* u2 setID must be the same for all cabinets in a set: 32-33 */
-		BIO_read(bio, bfb, 2);
-		EVP_DigestUpdate(mdctx, bfb, 2);
+		if (!cab_add_span(spans, nspans, 8, 34))
+			return 0; /* FAILED */
+		nfolders = GET_UINT16_LE(indata + 26);
+		flags = GET_UINT16_LE(indata + 30);
 		/*
-		* u2 iCabinet - number of this cabinet file in a set: 34-35
-		* u2 cbCFHeader: 36-37
-		* u1 cbCFFolder: 38
-		* u1 cbCFData: 39
-		* u22 abReserve: 40-55
-		* - Additional data offset: 44-47
-		* - Additional data size: 48-51
-		*/
-		BIO_read(bio, bfb, 22);
-		/* u22 abReserve: 56-59 */
-		BIO_read(bio, bfb, 4);
-		EVP_DigestUpdate(mdctx, bfb, 4);
-		/* TODO */
+		 * u2 iCabinet - number of this cabinet file in a set: 34-35,
+		 * u2 cbCFHeader: 36-37, u1 cbCFFolder: 38, u1 cbCFData: 39 and
+		 * the additional data offset/size in abReserve: 40-55 are
+		 * excluded, the rest of abReserve: 56-59 is hashed
+		 */
+		pos = 60;
 		if (flags & FLAG_PREV_CABINET) {
 			/* szCabinetPrev */
-			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-				pos++;
-			} while (bfb[0] && pos < offset);
+			while (pos < offset && indata[pos++]);
 			/* szDiskPrev */
-			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-				pos++;
-			} while (bfb[0] && pos < offset);
+			while (pos < offset && indata[pos++]);
 		}
 		if (flags & FLAG_NEXT_CABINET) {
 			/* szCabinetNext */
-			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-				pos++;
-			} while (bfb[0] && pos < offset);
+			while (pos < offset && indata[pos++]);
 			/* szDiskNext */
-			do {
-				BIO_read(bio, bfb, 1);
-				EVP_DigestUpdate(mdctx, bfb, 1);
-				pos++;
-			} while (bfb[0] && pos < offset);
+			while (pos < offset && indata[pos++]);
 		}
 		/*
 		 * (u8 * cFolders) CFFOLDER - structure contains information about
 		 * one of the folders or partial folders stored in this cabinet file
 		 */
-		while (nfolders) {
-			BIO_read(bio, bfb, 8);
-			EVP_DigestUpdate(mdctx, bfb, 8);
-			nfolders--;
-		}
-	} else {
-		/* read what's left of the unsigned PE file */
-		coffFiles = 8;
+		if (offset - pos < (uint32_t)nfolders * 8)
+			return 0; /* FAILED */
+		if (!cab_add_span(spans, nspans, 56, pos + (uint32_t)nfolders * 8))
+			return 0; /* FAILED */
+		/* (variable) ab - the compressed data bytes */
+		return cab_add_span(spans, nspans, GET_UINT32_LE(indata + 16), offset);
 	}
-	/* (variable) ab - the compressed data bytes */
-	while (coffFiles < offset) {
-		int l;
-		uint32_t want = offset - coffFiles;
-		if (want > sizeof bfb)
-			want = sizeof bfb;
-		l = BIO_read(bio, bfb, (int)want);
-		if (l <= 0)
-			break;
-		EVP_DigestUpdate(mdctx, bfb, (size_t)l);
-		coffFiles += (uint32_t)l;
+	/* read what's left of the unsigned CAB file */
+	return cab_add_span(spans, nspans, 8, offset);
+}
+
+/* Compute digests with all requested algorithms in one pass over the CAB file */
+static int cab_calc_digests(char *indata, const int *mdtypes, int count,
+			DIGEST_CACHE *cache, FILE_HEADER *header)
+{
+	EVP_MD_CTX *mdctx[MAX_DIGEST_CACHE];
+	CAB_SPAN spans[MAX_CAB_SPAN];
+	uint32_t offset;
+	int i, nspans, ret = 0;
+
+	if (count <= 0 || count > MAX_DIGEST_CACHE)
+		return 0; /* FAILED */
+	if (header->sigpos)
+		offset = header->sigpos;
+	else
+		offset = header->fileend;
+	if (!cab_calc_spans(indata, header, offset, spans, &nspans)) {
+		printf("Corrupt CAB file header\n");
+		return 0; /* FAILED */
 	}
-	OPENSSL_free(bfb);
-	BIO_free(bio);
-	EVP_DigestFinal(mdctx, mdbuf, NULL);
+	advise_sequential(indata, offset);
+	if (!digests_init(mdctx, mdtypes, count))
+		goto err;
+	for (i = 0; i < nspans; i++) {
+		uint32_t pos = spans[i].begin, released = spans[i].begin;
+
+		while (pos < spans[i].end) {
+			uint32_t want = spans[i].end - pos;
+			if (want > SIZE_16M)
+				want = SIZE_16M;
+			digests_update(mdctx, count, (u_char *)indata + pos, (size_t)want);
+			pos += want;
+			/* keep the resident window bounded for large files */
+			unmap_consumed(indata, released, pos);
+			released = pos;
+		}
+	}
+	digests_final(mdctx, mdtypes, count, cache);
 	ret = 1; /* OK */
 err:
-	EVP_MD_CTX_free(mdctx);
+	digests_free(mdctx, count);
 	return ret;
 }
 
+static int cab_calc_digest(char *indata, int mdtype, u_char *mdbuf, FILE_HEADER *header)
+{
+	DIGEST_CACHE cache;
+
+	cache.count = 0;
+	if (!cab_calc_digests(indata, &mdtype, 1, &cache, header))
+		return 0; /* FAILED */
+	memcpy(mdbuf, digest_cache_get(&cache, mdtype), EVP_MAX_MD_SIZE);
+	return 1; /* OK */
+}
+
 static int cab_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *header,
-			GLOBAL_OPTIONS *options)
+			DIGEST_CACHE *cache, GLOBAL_OPTIONS *options)
 {
 	int ret = 1, mdtype = -1;
 	u_char mdbuf[EVP_MAX_MD_SIZE];
 	u_char cmdbuf[EVP_MAX_MD_SIZE];
+	u_char *digest;
 
 	if (is_content_type(signature->p7, SPC_INDIRECT_DATA_OBJID)) {
 		ASN1_STRING *content_val = signature->p7->d.sign->contents->d.other->value.sequence;
@@ -3845,7 +5085,10 @@ static int cab_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *hea
 		printf("Failed to extract current message digest\n\n");
 		goto out;
 	}
-	if (!cab_calc_digest(indata, mdtype, cmdbuf, header)) {
+	digest = cache ? digest_cache_get(cache, mdtype) : NULL;
+	if (digest) {
+		memcpy(cmdbuf, digest, sizeof cmdbuf);
+	} else if (!cab_calc_digest(indata, mdtype, cmdbuf, header)) {
 		printf("Failed to calculate message digest\n\n");
 		goto out;
 	}
@@ -3871,12 +5114,22 @@ static PKCS7 *extract_existing_pkcs7(char *indata, FILE_HEADER *header)
 	return p7;
 }
 
+static int cab_verify_signature(SIGNATURE *signature, void *arg)
+{
+	PE_VERIFY_CTX *ctx = arg;
+
+	return cab_verify_pkcs7(signature, ctx->indata, ctx->header, ctx->cache, ctx->options);
+}
+
 static int cab_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *options)
 {
-	int i, ret = 1;
+	int ret = 1;
+	int mdtypes[MAX_DIGEST_CACHE], nmdtypes;
 	PKCS7 *p7;
+	DIGEST_CACHE cache;
 	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
 
+	cache.count = 0;
 	if (header->header_size != 20) {
 		printf("No signature found\n\n");
 		goto out;
@@ -3890,17 +5143,28 @@ static int cab_verify_file(char *indata, FILE_HEADER *header, GLOBAL_OPTIONS *op
 		printf("Failed to extract PKCS7 data\n\n");
 		goto out;
 	}
-	if (!append_signature_list(&signatures, p7, 1)) {
+	if (!append_signature_list(signatures, p7, 1, 0)) {
 		printf("Failed to create signature list\n\n");
 		PKCS7_free(p7);
 		goto out;
 	}
-	for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
-		SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
-		printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
-		ret &= cab_verify_pkcs7(signature, indata, header, options);
+	/* compute the digests of all signatures in a single pass over the file */
+	if (!options->fast) {
+		signature_list_decode(signatures);
+		nmdtypes = signatures_get_mdtypes(signatures, mdtypes);
+		if (nmdtypes > 0 && !cab_calc_digests(indata, mdtypes, nmdtypes, &cache, header)) {
+			cache.count = 0; /* fall back to a per-signature pass */
+		}
+	}
+	{
+		PE_VERIFY_CTX ctx;
+
+		ctx.indata = indata;
+		ctx.header = header;
+		ctx.cache = &cache;
+		ctx.options = options;
+		ret &= verify_signatures(signatures, cab_verify_signature, &ctx, 1, options);
 	}
-	printf("Number of verified signatures: %d\n", i);
 out:
 	sk_SIGNATURE_pop_free(signatures, signature_free);
 	return ret;
@@ -4201,7 +5465,7 @@ static int cat_verify_header(char *indata, uint32_t filesize, FILE_HEADER *heade
  * from the content and compare the message digest against the computed message digest of the file
  */
 static int cat_verify_member(CatalogAuthAttr *attribute, char *indata, FILE_HEADER *header,
-			file_type_t filetype)
+			file_type_t filetype, int nthreads)
 {
 	int ret = 1;
 	u_char *ph = NULL;
@@ -4264,7 +5528,7 @@ static int cat_verify_member(CatalogAuthAttr *attribute, char *indata, FILE_HEAD
 			default:
 				break;
 			}
-		mdlen = EVP_MD_size(EVP_get_digestbynid(mdtype));
+		mdlen = EVP_MD_size(md_by_nid(mdtype));
 		if (!memcmp(mdbuf, cmdbuf, (size_t)mdlen)) {
 			printf("Message digest algorithm  : %s\n", OBJ_nid2sn(mdtype));
 			print_hash("Current message digest    ", "", mdbuf, mdlen);
@@ -4272,7 +5536,7 @@ static int cat_verify_member(CatalogAuthAttr *attribute, char *indata, FILE_HEAD
 		} else {
 			goto out;
 		}
-		if (phlen > 0 && !pe_page_hash(indata, header, ph, phlen, phtype)) {
+		if (phlen > 0 && !pe_page_hash(indata, header, ph, phlen, phtype, nthreads)) {
 			printf("Signature verification: failed\n\n");
 			goto out;
 		}
@@ -4284,6 +5548,127 @@ out:
 	return ret;
 }
 
+/*
+ * If the attribute type is SPC_INDIRECT_DATA_OBJID, extract the digest
+ * algorithm and the message digest of the catalog member
+ */
+static int cat_member_digest(CatalogAuthAttr *attribute, int *mdtype, u_char *mdbuf, int *mdlen)
+{
+	int ret = 0;
+	ASN1_OBJECT *indir_objid = OBJ_txt2obj(SPC_INDIRECT_DATA_OBJID, 1);
+
+	if (attribute && !OBJ_cmp(attribute->type, indir_objid)) {
+		ASN1_TYPE *content;
+		SpcIndirectDataContent *idc;
+		ASN1_STRING *content_val = attribute->contents->value.sequence;
+		const u_char *p = content_val->data;
+		STACK_OF(ASN1_TYPE) *contents = d2i_ASN1_SET_ANY(NULL, &p, content_val->length);
+		if (contents == NULL)
+			goto out;
+		content = sk_ASN1_TYPE_value(contents, 0);
+		sk_ASN1_TYPE_free(contents);
+		content_val = content->value.sequence;
+		p = content_val->data;
+		idc = d2i_SpcIndirectDataContent(NULL, &p, content_val->length);
+		if (idc) {
+			if (idc->messageDigest && idc->messageDigest->digest && idc->messageDigest->digestAlgorithm
+					&& idc->messageDigest->digest->length <= EVP_MAX_MD_SIZE) {
+				*mdtype = OBJ_obj2nid(idc->messageDigest->digestAlgorithm->algorithm);
+				*mdlen = idc->messageDigest->digest->length;
+				memcpy(mdbuf, idc->messageDigest->digest->data, (size_t)idc->messageDigest->digest->length);
+				ret = 1; /* OK */
+			}
+			SpcIndirectDataContent_free(idc);
+		}
+		ASN1_TYPE_free(content);
+	}
+out:
+	ASN1_OBJECT_free(indir_objid);
+	return ret;
+}
+
+typedef struct {
+	int mdtype;
+	int mdlen;
+	u_char digest[EVP_MAX_MD_SIZE];
+	CatalogAuthAttr *attribute;
+} CatalogMember;
+
+/*
+ * Catalog member index: every member's message digest decoded once and
+ * sorted, so looking a file up is a binary search instead of a linear
+ * walk with per-member ASN.1 decoding. The index persists for the whole
+ * process, so batch verification decodes each catalog file only once.
+ */
+typedef struct {
+	char *catalog; /* path of the catalog file the index was built from */
+	MsCtlContent *ctlc; /* keeps the member attribute pointers alive */
+	CatalogMember *members;
+	int count;
+} CAT_INDEX;
+
+static CAT_INDEX cat_index;
+
+static int cat_member_cmp(const void *a, const void *b)
+{
+	const CatalogMember *ma = a, *mb = b;
+
+	if (ma->mdtype != mb->mdtype)
+		return ma->mdtype < mb->mdtype ? -1 : 1;
+	if (ma->mdlen != mb->mdlen)
+		return ma->mdlen < mb->mdlen ? -1 : 1;
+	return memcmp(ma->digest, mb->digest, (size_t)ma->mdlen);
+}
+
+static void cat_index_free(void)
+{
+	OPENSSL_free(cat_index.members);
+	MsCtlContent_free(cat_index.ctlc);
+	OPENSSL_free(cat_index.catalog);
+	memset(&cat_index, 0, sizeof cat_index);
+}
+
+static int cat_index_build(PKCS7 *p7, GLOBAL_OPTIONS *options)
+{
+	MsCtlContent *ctlc;
+	ASN1_STRING *content_val = p7->d.sign->contents->d.other->value.sequence;
+	const u_char *p = content_val->data;
+	int i, j, num = 0;
+
+	ctlc = d2i_MsCtlContent(NULL, &p, content_val->length);
+	if (!ctlc)
+		return 0; /* FAILED */
+	for (i = 0; i < sk_CatalogInfo_num(ctlc->header_attributes); i++) {
+		CatalogInfo *header_attr = sk_CatalogInfo_value(ctlc->header_attributes, i);
+		if (header_attr)
+			num += sk_CatalogAuthAttr_num(header_attr->attributes);
+	}
+	cat_index.members = OPENSSL_malloc((size_t)(num ? num : 1) * sizeof(CatalogMember));
+	cat_index.count = 0;
+	for (i = 0; i < sk_CatalogInfo_num(ctlc->header_attributes); i++) {
+		STACK_OF(CatalogAuthAttr) *attributes;
+		CatalogInfo *header_attr = sk_CatalogInfo_value(ctlc->header_attributes, i);
+		if (header_attr == NULL)
+			continue;
+		attributes = header_attr->attributes;
+		for (j = 0; j < sk_CatalogAuthAttr_num(attributes); j++) {
+			CatalogAuthAttr *attribute = sk_CatalogAuthAttr_value(attributes, j);
+			CatalogMember *member = &cat_index.members[cat_index.count];
+			if (!attribute)
+				continue;
+			memset(member, 0, sizeof(CatalogMember));
+			if (!cat_member_digest(attribute, &member->mdtype, member->digest, &member->mdlen))
+				continue;
+			member->attribute = attribute;
+			cat_index.count++;
+		}
+	}
+	qsort(cat_index.members, (size_t)cat_index.count, sizeof(CatalogMember), cat_member_cmp);
+	cat_index.ctlc = ctlc;
+	cat_index.catalog = OPENSSL_strdup(options->catalog);
+	return 1; /* OK */
+}
+
 /*
  * If the message digest of the input file is found in the catalog file,
  * or the input file itself is a catalog file, verify the signature.
@@ -4295,31 +5680,47 @@ static int cat_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *hea
 
 	/* A CTL (MS_CTL_OBJID) is a list of hashes of certificates or a list of hashes files */
 	if (options->catalog && is_content_type(signature->p7, MS_CTL_OBJID)) {
-		ASN1_STRING *content_val = signature->p7->d.sign->contents->d.other->value.sequence;
-		const u_char *p = content_val->data;
-		MsCtlContent *ctlc = d2i_MsCtlContent(NULL, &p, content_val->length);
-		if (ctlc) {
-			int i, j;
-			/* find the message digest of the file for all files added to the catalog file */
-			for (i = 0; i < sk_CatalogInfo_num(ctlc->header_attributes); i++) {
-				STACK_OF(CatalogAuthAttr) *attributes;
-				CatalogInfo *header_attr = sk_CatalogInfo_value(ctlc->header_attributes, i);
-				if (header_attr == NULL)
+		if (cat_index.catalog && strcmp(cat_index.catalog, options->catalog))
+			cat_index_free();
+		if (!cat_index.catalog && !cat_index_build(signature->p7, options))
+			printf("Failed to index the catalog file\n\n");
+		if (cat_index.catalog) {
+			int i, lasttype = -1;
+			/* compute the message digest of the file once per digest algorithm
+			 * used in the catalog file and look it up in the member index */
+			for (i = 0; i < cat_index.count && !ok; i++) {
+				CatalogMember key, *found;
+				int mdtype = cat_index.members[i].mdtype;
+				if (mdtype == lasttype)
 					continue;
-				attributes = header_attr->attributes;
-				for (j = 0; j < sk_CatalogAuthAttr_num(attributes); j++) {
-					CatalogAuthAttr *attribute = sk_CatalogAuthAttr_value(attributes, j);
-					if (!cat_verify_member(attribute, indata, header, filetype)) {
-						/* computed message digest of the file is found in the catalog file */
-						ok = 1;
+				lasttype = mdtype;
+				memset(&key, 0, sizeof key);
+				key.mdtype = mdtype;
+				key.mdlen = EVP_MD_size(md_by_nid(mdtype));
+				switch (filetype) {
+					case FILE_TYPE_CAB:
+						if (cab_calc_digest(indata, mdtype, key.digest, header))
+							continue;
+						break;
+					case FILE_TYPE_PE:
+						if (!pe_calc_digest(indata, mdtype, key.digest, header))
+							continue;
+						break;
+					case FILE_TYPE_MSI:
+						if (!msi_calc_digest(indata, mdtype, key.digest, header->fileend))
+							continue;
+						break;
+					default:
 						break;
-					}
 				}
-				if (ok) {
-					break;
+				found = bsearch(&key, cat_index.members, (size_t)cat_index.count,
+					sizeof(CatalogMember), cat_member_cmp);
+				if (found && !cat_verify_member(found->attribute, indata, header,
+						filetype, options->threads)) {
+					/* computed message digest of the file is found in the catalog file */
+					ok = 1;
 				}
 			}
-			MsCtlContent_free(ctlc);
 		}
 	} else {
 		/* the input file is a catalog file */
@@ -4336,10 +5737,24 @@ static int cat_verify_pkcs7(SIGNATURE *signature, char *indata, FILE_HEADER *hea
 	return ret;
 }
 
+typedef struct {
+	char *indata;
+	FILE_HEADER *header;
+	file_type_t filetype;
+	GLOBAL_OPTIONS *options;
+} CAT_VERIFY_CTX;
+
+static int cat_verify_signature(SIGNATURE *signature, void *arg)
+{
+	CAT_VERIFY_CTX *ctx = arg;
+
+	return cat_verify_pkcs7(signature, ctx->indata, ctx->header, ctx->filetype, ctx->options);
+}
+
 static int cat_verify_file(char *catdata, FILE_HEADER *catheader,
 				char *indata, FILE_HEADER *header, file_type_t filetype, GLOBAL_OPTIONS *options)
 {
-	int i, ret = 1;
+	int ret = 1;
 	PKCS7 *p7;
 	STACK_OF(SIGNATURE) *signatures = sk_SIGNATURE_new_null();
 
@@ -4352,18 +5767,21 @@ static int cat_verify_file(char *catdata, FILE_HEADER *catheader,
 		p7 = cat_extract_existing_pkcs7(catdata, catheader);
 	else
 		p7 = cat_extract_existing_pkcs7(indata, header);
-	if (!append_signature_list(&signatures, p7, 1)) {
+	if (!append_signature_list(signatures, p7, 1, 0)) {
 		printf("Failed to create signature list\n\n");
 		PKCS7_free(p7);
 		goto out;
 	}
-	for (i = 0; i < sk_SIGNATURE_num(signatures); i++) {
-		SIGNATURE *signature = sk_SIGNATURE_value(signatures, i);
-		if (!options->catalog)
-			printf("Signature Index: %d %s\n", i, i==0 ? " (Primary Signature)" : "");
-		ret &= cat_verify_pkcs7(signature, indata, header, filetype, options);
+	{
+		CAT_VERIFY_CTX ctx;
+
+		ctx.indata = indata;
+		ctx.header = header;
+		ctx.filetype = filetype;
+		ctx.options = options;
+		ret &= verify_signatures(signatures, cat_verify_signature, &ctx,
+			!options->catalog, options);
 	}
-	printf("Number of verified signatures: %d\n", i);
 out:
 	sk_SIGNATURE_pop_free(signatures, signature_free);
 	return ret;
@@ -4544,6 +5962,81 @@ static int add_unauthenticated_blob(PKCS7 *sig)
 /*
  * Append signature to the outfile
  */
+/*
+ * Patch the new certificate table into the input file itself, so replacing
+ * a signature costs I/O proportional to the signature size, not the file size.
+ * The security directory entry and the PE checksum are updated afterwards.
+ * When the new table fits into the region occupied by the current one, it is
+ * padded out with zeroes so the file size does not change at all.
+ */
+static int pe_update_signature_inplace(BIO *certtable, GLOBAL_OPTIONS *options,
+		FILE_HEADER *header, uint32_t filesize)
+{
+	FILE *file;
+	BIO *bio;
+	char *table = NULL;
+	u_char buf[8], zeroes[4096];
+	long tablelen;
+	uint32_t data_end, table_offset, table_size, new_size;
+
+	tablelen = BIO_get_mem_data(certtable, &table);
+	if (tablelen <= 0 || !table)
+		return 1; /* FAILED */
+	data_end = header->sigpos > 0 ? header->sigpos : filesize;
+	table_offset = header->fileend; /* 8 byte aligned by pe_modify_header() */
+	table_size = (uint32_t)tablelen;
+	if (header->sigpos > 0 && header->sigpos + header->siglen > table_offset + table_size) {
+		/* reuse the whole current certificate table region */
+		table_size = header->sigpos + header->siglen - table_offset;
+		PUT_UINT32_LE(table_size, table); /* dwLength */
+	}
+	new_size = table_offset + table_size;
+
+	file = fopen(options->infile, "r+b");
+	if (!file) {
+		printf("Failed to open file for writing: %s\n", options->infile);
+		return 1; /* FAILED */
+	}
+	memset(zeroes, 0, sizeof zeroes);
+	/* zero out the gap the 8 byte alignment may have left before the table */
+	if (table_offset > data_end) {
+		fseek(file, (long)data_end, SEEK_SET);
+		fwrite(zeroes, 1, (size_t)(table_offset - data_end), file);
+	}
+	fseek(file, (long)table_offset, SEEK_SET);
+	fwrite(table, 1, (size_t)tablelen, file);
+	/* pad (with 0's) the reused certificate table region */
+	while ((uint32_t)tablelen < table_size) {
+		size_t n = table_size - (uint32_t)tablelen;
+		if (n > sizeof zeroes)
+			n = sizeof zeroes;
+		fwrite(zeroes, 1, n, file);
+		tablelen += (long)n;
+	}
+	/* update signature position and size */
+	fseek(file, (long)(header->header_size + 152 + header->pe32plus * 16), SEEK_SET);
+	PUT_UINT32_LE(table_offset, buf);
+	PUT_UINT32_LE(table_size, buf + 4);
+	fwrite(buf, 1, 8, file);
+	fflush(file);
+	if (filesize != new_size) {
+#ifdef WIN32
+		if (_chsize(_fileno(file), (long)new_size)) {
+#else
+		if (ftruncate(fileno(file), (off_t)new_size)) {
+#endif /* WIN32 */
+			printf("Failed to resize file: %s\n", options->infile);
+			fclose(file);
+			return 1; /* FAILED */
+		}
+	}
+	bio = BIO_new_fp(file, BIO_NOCLOSE);
+	pe_recalc_checksum(bio, header);
+	BIO_free(bio);
+	fclose(file);
+	return 0; /* OK */
+}
+
 static int append_signature(PKCS7 *sig, PKCS7 *cursig, file_type_t type,
 			GLOBAL_OPTIONS *options, MSI_PARAMS *msiparams, int *padlen, int *len, BIO *outdata)
 {
@@ -4674,6 +6167,96 @@ static uint32_t get_file_size(const char *infile)
 	return (uint32_t)st.st_size;
 }
 
+/*
+ * Lightweight per-phase instrumentation enabled with the -perf-stats option.
+ * Phases accumulate wall-clock time between their boundaries, so the batch
+ * and daemon commands sum over all processed files.  The summary is printed
+ * to stderr as a single JSON object, keeping stdout for the regular log.
+ */
+typedef struct {
+	int enabled;
+	int files;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	double map;
+	double presign;
+	double signature;
+	double timestamp;
+	double append;
+	double start;
+} PERF_STATS;
+
+static PERF_STATS perf_stats;
+
+static double perf_now(void)
+{
+#ifdef WIN32
+	return (double)GetTickCount64() / 1000.0;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif /* WIN32 */
+}
+
+static void perf_phase(double *acc, double since)
+{
+	if (perf_stats.enabled)
+		*acc += perf_now() - since;
+}
+
+static void perf_stats_report(void)
+{
+	/* the hashing pass runs between the map and signature phases */
+	double digest = perf_stats.presign - perf_stats.signature;
+
+	fprintf(stderr, "{\"files\":%d,\"bytes_in\":%llu,\"bytes_out\":%llu,"
+		"\"map_s\":%.6f,\"digest_s\":%.6f,\"signature_s\":%.6f,"
+		"\"timestamp_s\":%.6f,\"append_s\":%.6f,\"total_s\":%.6f}\n",
+		perf_stats.files,
+		(unsigned long long)perf_stats.bytes_in,
+		(unsigned long long)perf_stats.bytes_out,
+		perf_stats.map, digest < 0 ? 0 : digest, perf_stats.signature,
+		perf_stats.timestamp, perf_stats.append,
+		perf_now() - perf_stats.start);
+}
+
+#ifndef WIN32
+/*
+ * Forward the counters accumulated since "since" over a pool worker's
+ * result pipe.  Worker and parent run the same binary, so the struct
+ * crosses the pipe as raw bytes.
+ */
+static int perf_stats_send(int fd, const PERF_STATS *since)
+{
+	PERF_STATS delta = perf_stats;
+
+	delta.files -= since->files;
+	delta.bytes_in -= since->bytes_in;
+	delta.bytes_out -= since->bytes_out;
+	delta.map -= since->map;
+	delta.presign -= since->presign;
+	delta.signature -= since->signature;
+	delta.timestamp -= since->timestamp;
+	delta.append -= since->append;
+	return write(fd, &delta, sizeof delta) == sizeof delta;
+}
+
+/* Accumulate the counters a pool worker forwarded to the parent */
+static void perf_stats_merge(const PERF_STATS *add)
+{
+	perf_stats.files += add->files;
+	perf_stats.bytes_in += add->bytes_in;
+	perf_stats.bytes_out += add->bytes_out;
+	perf_stats.map += add->map;
+	perf_stats.presign += add->presign;
+	perf_stats.signature += add->signature;
+	perf_stats.timestamp += add->timestamp;
+	perf_stats.append += add->append;
+}
+#endif /* WIN32 */
+
 static char *map_file(const char *infile, const size_t size)
 {
 	char *indata = NULL;
@@ -4699,6 +6282,13 @@ static char *map_file(const char *infile, const size_t size)
 	if (indata == MAP_FAILED) {
 		return NULL;
 	}
+#ifdef MADV_HUGEPAGE
+	/* multi-gigabyte inputs walk fewer page table entries with huge
+	   page backing; kernels without large folio support for file
+	   mappings simply ignore the hint */
+	if (size >= SIZE_16M)
+		madvise(indata, size, MADV_HUGEPAGE);
+#endif /* MADV_HUGEPAGE */
 #else
 	printf("No file mapping function\n");
 	return NULL;
@@ -5294,8 +6884,10 @@ out:
 
 static void free_msi_params(MSI_PARAMS *msiparams)
 {
-	msi_file_free(msiparams->msi);
+	/* the dirent tree nodes live in the MSI file's arena,
+	   so the tree must be torn down before the file */
 	msi_dirent_free(msiparams->dirent);
+	msi_file_free(msiparams->msi);
 }
 
 static void free_crypto_params(CRYPTO_PARAMS *cparams)
@@ -5396,6 +6988,8 @@ static PKCS7 *get_pkcs7(cmd_type_t cmd, BIO *hash, file_type_t type, char *indat
 			return NULL; /* FAILED */
 		}
 	} else if (cmd == CMD_SIGN) {
+		double pt = perf_now();
+
 		sig = create_new_signature(type, options, cparams);
 		if (!sig) {
 			printf("Creating a new signature failed\n");
@@ -5414,6 +7008,7 @@ static PKCS7 *get_pkcs7(cmd_type_t cmd, BIO *hash, file_type_t type, char *indat
 				return NULL; /* FAILED */
 			}
 		}
+		perf_phase(&perf_stats.signature, pt);
 	}
 	return sig;
 }
@@ -5599,6 +7194,10 @@ static cmd_type_t get_command(char **argv)
 		return CMD_HELP;
 	} else if (!strcmp(argv[1], "sign"))
 		return CMD_SIGN;
+	else if (!strcmp(argv[1], "sign-batch"))
+		return CMD_SIGN_BATCH;
+	else if (!strcmp(argv[1], "daemon"))
+		return CMD_DAEMON;
 	else if (!strcmp(argv[1], "extract-signature"))
 		return CMD_EXTRACT;
 	else if (!strcmp(argv[1], "attach-signature"))
@@ -5607,6 +7206,8 @@ static cmd_type_t get_command(char **argv)
 		return CMD_REMOVE;
 	else if (!strcmp(argv[1], "verify"))
 		return CMD_VERIFY;
+	else if (!strcmp(argv[1], "verify-batch"))
+		return CMD_VERIFY_BATCH;
 	else if (!strcmp(argv[1], "add"))
 		return CMD_ADD;
 	return CMD_SIGN;
@@ -5627,11 +7228,12 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 	options->md = EVP_sha256();
 	options->time = INVALID_TIME;
 	options->jp = -1;
+	options->threads = 1;
 
 	if (*cmd == CMD_HELP) {
 		return 0; /* FAILED */
 	}
-	if (*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) {
+	if (*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH || *cmd == CMD_ATTACH || *cmd == CMD_DAEMON) {
 		options->cafile = get_cafile();
 		options->tsa_cafile = get_cafile();
 	}
@@ -5654,25 +7256,31 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 				return 0; /* FAILED */
 			}
 			options->sigfile = *(++argv);
-		} else if ((*cmd == CMD_SIGN) && (!strcmp(*argv, "-spc") || !strcmp(*argv, "-certs"))) {
+		} else if (*cmd == CMD_DAEMON && !strcmp(*argv, "-socket")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->socketpath = *(++argv);
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && (!strcmp(*argv, "-spc") || !strcmp(*argv, "-certs"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->certfile = *(++argv);
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-ac")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-ac")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->xcertfile = *(++argv);
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-key")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-key")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->keyfile = *(++argv);
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-pkcs12")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-pkcs12")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
@@ -5681,26 +7289,26 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 		} else if ((*cmd == CMD_EXTRACT) && !strcmp(*argv, "-pem")) {
 			options->output_pkcs7 = 1;
 #ifndef OPENSSL_NO_ENGINE
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-pkcs11cert")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-pkcs11cert")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->p11cert = *(++argv);
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-pkcs11engine")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-pkcs11engine")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->p11engine = *(++argv);
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-pkcs11module")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-pkcs11module")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->p11module = *(++argv);
 #endif /* OPENSSL_NO_ENGINE */
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-pass")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-pass")) {
 			if (options->askpass || options->readpass) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
@@ -5712,14 +7320,14 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			options->pass = OPENSSL_strdup(*(++argv));
 			memset(*argv, 0, strlen(*argv));
 #ifdef PROVIDE_ASKPASS
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-askpass")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-askpass")) {
 			if (options->pass || options->readpass) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->askpass = 1;
 #endif
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-readpass")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-readpass")) {
 			if (options->askpass || options->pass) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
@@ -5729,17 +7337,23 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 				return 0; /* FAILED */
 			}
 			options->readpass = *(++argv);
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-comm")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-digest-cache")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->digest_cache = *(++argv);
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-comm")) {
 			options->comm = 1;
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-ph")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-ph")) {
 			options->pagehash = 1;
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-n")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-n")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->desc = *(++argv);
-		} else if ((*cmd == CMD_SIGN|| *cmd == CMD_ADD || *cmd == CMD_ATTACH)
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD || *cmd == CMD_ATTACH)
 				&& !strcmp(*argv, "-h")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
@@ -5760,13 +7374,13 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
-		} else if ((*cmd == CMD_SIGN) && !strcmp(*argv, "-i")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !strcmp(*argv, "-i")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->url = *(++argv);
-		} else if ((*cmd == CMD_ATTACH || *cmd == CMD_SIGN || *cmd == CMD_VERIFY)
+		} else if ((*cmd == CMD_ATTACH || *cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH)
 				&& (!strcmp(*argv, "-time") || !strcmp(*argv, "-st"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
@@ -5774,70 +7388,84 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			}
 			options->time = (time_t)strtoul(*(++argv), NULL, 10);
 #ifdef ENABLE_CURL
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD) && !strcmp(*argv, "-t")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD) && !strcmp(*argv, "-t")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->turl[options->nturl++] = *(++argv);
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD) && !strcmp(*argv, "-ts")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD) && !strcmp(*argv, "-ts")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->tsurl[options->ntsurl++] = *(++argv);
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD) && !strcmp(*argv, "-p")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD) && !strcmp(*argv, "-p")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->proxy = *(++argv);
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD) && !strcmp(*argv, "-noverifypeer")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD) && !strcmp(*argv, "-noverifypeer")) {
 			options->noverifypeer = 1;
 #endif
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD) && !strcmp(*argv, "-addUnauthenticatedBlob")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD) && !strcmp(*argv, "-addUnauthenticatedBlob")) {
 			options->addBlob = 1;
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ATTACH) && !strcmp(*argv, "-nest")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD) && !strcmp(*argv, "-inplace")) {
+			options->inplace = 1;
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ATTACH) && !strcmp(*argv, "-nest")) {
 			options->nest = 1;
-		} else if ((*cmd == CMD_VERIFY) && !strcmp(*argv, "-ignore-timestamp")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH) && !strcmp(*argv, "-ignore-timestamp")) {
 			options->ignore_timestamp = 1;
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD || *cmd == CMD_VERIFY) && !strcmp(*argv, "-verbose")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH) && !strcmp(*argv, "-fast")) {
+			options->fast = 1;
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD || *cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH) && !strcmp(*argv, "-verbose")) {
 			options->verbose = 1;
-		} else if ((*cmd == CMD_SIGN || *cmd == CMD_ADD || *cmd == CMD_ATTACH) && !strcmp(*argv, "-add-msi-dse")) {
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD || *cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH) && !strcmp(*argv, "-perf-stats")) {
+			perf_stats.enabled = 1;
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ATTACH || *cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH) && !strcmp(*argv, "-threads")) {
+			if (--argc < 1) {
+				usage(argv0, "all");
+				return 0; /* FAILED */
+			}
+			options->threads = (int)strtoul(*(++argv), NULL, 10);
+			if (options->threads < 1)
+				options->threads = 1;
+		} else if ((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON || *cmd == CMD_ADD || *cmd == CMD_ATTACH) && !strcmp(*argv, "-add-msi-dse")) {
 			options->add_msi_dse = 1;
-		} else if ((*cmd == CMD_VERIFY) && (!strcmp(*argv, "-c") || !strcmp(*argv, "-catalog"))) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH) && (!strcmp(*argv, "-c") || !strcmp(*argv, "-catalog"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->catalog = *(++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && !strcmp(*argv, "-CAfile")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH || *cmd == CMD_ATTACH) && !strcmp(*argv, "-CAfile")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			OPENSSL_free(options->cafile);
 			options->cafile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && !strcmp(*argv, "-CRLfile")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH || *cmd == CMD_ATTACH) && !strcmp(*argv, "-CRLfile")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->crlfile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && (!strcmp(*argv, "-untrusted") || !strcmp(*argv, "-TSA-CAfile"))) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH || *cmd == CMD_ATTACH) && (!strcmp(*argv, "-untrusted") || !strcmp(*argv, "-TSA-CAfile"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
       }
 			OPENSSL_free(options->tsa_cafile);
 			options->tsa_cafile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && (!strcmp(*argv, "-CRLuntrusted") || !strcmp(*argv, "-TSA-CRLfile"))) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH || *cmd == CMD_ATTACH) && (!strcmp(*argv, "-CRLuntrusted") || !strcmp(*argv, "-TSA-CRLfile"))) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
 			}
 			options->tsa_crlfile = OPENSSL_strdup(*++argv);
-		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && !strcmp(*argv, "-require-leaf-hash")) {
+		} else if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH || *cmd == CMD_ATTACH) && !strcmp(*argv, "-require-leaf-hash")) {
 			if (--argc < 1) {
 				usage(argv0, "all");
 				return 0; /* FAILED */
@@ -5863,10 +7491,22 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 			help_for(argv0, "sign");
 			*cmd = CMD_HELP;
 			return 0; /* FAILED */
+		} else if ((*cmd == CMD_SIGN_BATCH) && !strcmp(*argv, "--help")) {
+			help_for(argv0, "sign-batch");
+			*cmd = CMD_HELP;
+			return 0; /* FAILED */
+		} else if ((*cmd == CMD_DAEMON) && !strcmp(*argv, "--help")) {
+			help_for(argv0, "daemon");
+			*cmd = CMD_HELP;
+			return 0; /* FAILED */
 		} else if ((*cmd == CMD_VERIFY) && !strcmp(*argv, "--help")) {
 			help_for(argv0, "verify");
 			*cmd = CMD_HELP;
 			return 0; /* FAILED */
+		} else if ((*cmd == CMD_VERIFY_BATCH) && !strcmp(*argv, "--help")) {
+			help_for(argv0, "verify-batch");
+			*cmd = CMD_HELP;
+			return 0; /* FAILED */
 		} else if (!strcmp(*argv, "-jp")) {
 			char *ap;
 			if (--argc < 1) {
@@ -5895,7 +7535,7 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 		options->infile = *(argv++);
 		argc--;
 	}
-	if (*cmd != CMD_VERIFY && (!options->outfile && argc > 0)) {
+	if (*cmd != CMD_VERIFY && *cmd != CMD_VERIFY_BATCH && *cmd != CMD_SIGN_BATCH && (!options->outfile && argc > 0)) {
 		if (!strcmp(*argv, "-out")) {
 			argv++;
 			argc--;
@@ -5909,9 +7549,12 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 #ifdef ENABLE_CURL
 		(options->nturl && options->ntsurl) ||
 #endif
-		!options->infile ||
-		(*cmd != CMD_VERIFY && !options->outfile) ||
-		(*cmd == CMD_SIGN && !((options->certfile && options->keyfile) ||
+		(*cmd != CMD_DAEMON && !options->infile) ||
+		(*cmd == CMD_DAEMON && !options->socketpath) ||
+		(*cmd != CMD_VERIFY && *cmd != CMD_VERIFY_BATCH && *cmd != CMD_SIGN_BATCH && *cmd != CMD_DAEMON &&
+			!options->inplace && !options->outfile) ||
+		(options->inplace && options->outfile) ||
+		((*cmd == CMD_SIGN || *cmd == CMD_SIGN_BATCH || *cmd == CMD_DAEMON) && !((options->certfile && options->keyfile) ||
 #ifndef OPENSSL_NO_ENGINE
 			options->p11engine || options->p11module ||
 #endif /* OPENSSL_NO_ENGINE */
@@ -5922,7 +7565,7 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 		return 0; /* FAILED */
 	}
 #ifndef WIN32
-	if ((*cmd == CMD_VERIFY || *cmd == CMD_ATTACH) && access(options->cafile, R_OK)) {
+	if ((*cmd == CMD_VERIFY || *cmd == CMD_VERIFY_BATCH || *cmd == CMD_ATTACH) && access(options->cafile, R_OK)) {
 		printf("Use the \"-CAfile\" option to add one or more trusted CA certificates to verify the signature.\n");
 		return 0; /* FAILED */
 	}
@@ -5930,59 +7573,25 @@ static int main_configure(int argc, char **argv, cmd_type_t *cmd, GLOBAL_OPTIONS
 	return 1; /* OK */
 }
 
-int main(int argc, char **argv)
+static int process_file(cmd_type_t cmd, GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
 {
-	GLOBAL_OPTIONS options;
 	FILE_HEADER header, catheader;
 	MSI_PARAMS msiparams;
-	CRYPTO_PARAMS cparams;
 	BIO *hash = NULL, *outdata = NULL;
 	PKCS7 *cursig = NULL, *sig = NULL;
 	char *indata = NULL, *catdata = NULL;
 	int ret = -1, len = 0, padlen = 0;
 	uint32_t filesize = 0;
+	double pt = 0;
 	file_type_t type = FILE_TYPE_ANY, filetype = FILE_TYPE_CAT;
-	cmd_type_t cmd = CMD_SIGN;
-
-	/* reset options */
-	memset(&options, 0, sizeof(GLOBAL_OPTIONS));
-
-	/* Set up OpenSSL */
-	if (!OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS
-			| OPENSSL_INIT_ADD_ALL_CIPHERS
-			| OPENSSL_INIT_ADD_ALL_DIGESTS
-			| OPENSSL_INIT_LOAD_CONFIG, NULL))
-		DO_EXIT_0("Failed to init crypto\n");
-
-	/* create some MS Authenticode OIDS we need later on */
-	if (!OBJ_create(SPC_STATEMENT_TYPE_OBJID, NULL, NULL) ||
-			!OBJ_create(MS_JAVA_SOMETHING, NULL, NULL) ||
-			!OBJ_create(SPC_SP_OPUS_INFO_OBJID, NULL, NULL) ||
-			!OBJ_create(SPC_NESTED_SIGNATURE_OBJID, NULL, NULL))
-		DO_EXIT_0("Failed to create objects\n");
-
-	/* reset crypto */
-	memset(&cparams, 0, sizeof(CRYPTO_PARAMS));
 
 	/* reset MSI parameters */
 	memset(&msiparams, 0, sizeof(MSI_PARAMS));
 	msiparams.msi = NULL;
 	msiparams.dirent = NULL;
 
-	/* commands and options initialization */
-	if (!main_configure(argc, argv, &cmd, &options))
-		goto err_cleanup;
-	if (!read_password(&options)) {
-		printf("Failed to read password from file: %s\n", options.readpass);
-		goto err_cleanup;
-	}
-
-	/* read key and certificates */
-	if (cmd == CMD_SIGN && !read_crypto_params(&options, &cparams))
-		goto err_cleanup;
-
 	/* check if indata is cab or pe */
-	filesize = get_file_size(options.infile);
+	filesize = get_file_size(options->infile);
 	if (filesize == 0)
 		goto err_cleanup;
 
@@ -5990,71 +7599,109 @@ int main(int argc, char **argv)
 	memset(&header, 0, sizeof(FILE_HEADER));
 	header.fileend = filesize;
 
-	indata = map_file(options.infile, filesize);
+	pt = perf_now();
+	indata = map_file(options->infile, filesize);
 	if (!indata)
-		DO_EXIT_1("Failed to open file: %s\n", options.infile);
+		DO_EXIT_1("Failed to open file: %s\n", options->infile);
+
+	if (cmd == CMD_EXTRACT)
+		/* only the header structures and the signature blob are read */
+		advise_random_access(indata, filesize);
 
-	if (!get_file_type(indata, options.infile, &type)) {
+	if (!get_file_type(indata, options->infile, &type)) {
 		ret = 1; /* Failed */
 		goto err_cleanup;
 	}
-	if (!input_validation(type, &options, &header, &msiparams, indata, filesize)) {
+	if (!input_validation(type, options, &header, &msiparams, indata, filesize)) {
 		ret = 1; /* Failed */
 		goto err_cleanup;
 	}
+	if (perf_stats.enabled) {
+		perf_stats.map += perf_now() - pt;
+		perf_stats.bytes_in += filesize;
+		perf_stats.files++;
+	}
 
 	/* search catalog file to determine whether the file is signed in a catalog */
-	if (options.catalog) {
-		uint32_t catsize = get_file_size(options.catalog);
+	if (options->catalog) {
+		uint32_t catsize = get_file_size(options->catalog);
 		if (catsize == 0)
 			goto err_cleanup;
-		catdata = map_file(options.catalog, catsize);
+		catdata = map_file(options->catalog, catsize);
 		if (catdata == NULL)
-			DO_EXIT_1("Failed to open file: %s\n", options.catalog);
+			DO_EXIT_1("Failed to open file: %s\n", options->catalog);
 		filetype = type;
-		if (!get_file_type(catdata, options.catalog, &type))
+		if (!get_file_type(catdata, options->catalog, &type))
 			goto err_cleanup;
 		/* reset file header */
 		memset(&catheader, 0, sizeof(FILE_HEADER));
 		catheader.fileend = catsize;
-		if (!input_validation(type, &options, &catheader, NULL, catdata, catsize)) {
+		if (!input_validation(type, options, &catheader, NULL, catdata, catsize)) {
 			ret = 1; /* Failed */
 			goto err_cleanup;
 		}
 	}
 
+	if (options->inplace && type != FILE_TYPE_PE)
+		DO_EXIT_1("In-place signing is only supported for PE files: %s\n", options->infile);
+
+	/* consult the on-disk digest cache before driving the hashing chain */
+	if (cmd == CMD_SIGN && options->digest_cache && type != FILE_TYPE_CAT) {
+		options->cachefile = digest_cache_file(options, &header, type);
+		if (options->cachefile && digest_cache_read(options->cachefile,
+				options->cached_digest, EVP_MD_size(options->md)))
+			options->cached_digest_len = EVP_MD_size(options->md);
+		/* a rebuilt MSI misses the identity key even when its streams
+		   are unchanged; fall back to a content fingerprint */
+		if (!options->cached_digest_len && type == FILE_TYPE_MSI) {
+			u_char sum[8];
+
+			if (msi_content_checksum(msiparams.msi, msiparams.dirent, sum)) {
+				options->content_cachefile = digest_cache_file_msi(options, sum);
+				if (options->content_cachefile && digest_cache_read(options->content_cachefile,
+						options->cached_digest, EVP_MD_size(options->md)))
+					options->cached_digest_len = EVP_MD_size(options->md);
+			}
+		}
+	}
 	hash = BIO_new(BIO_f_md());
-	if (!BIO_set_md(hash, options.md)) {
+	/* on a cache hit the digest is injected, so the hashing pass is skipped */
+	if (!BIO_set_md(hash, options->cached_digest_len > 0 ? EVP_md_null() : options->md)) {
 		printf("Unable to set the message digest of BIO\n");
 		BIO_free_all(hash);
 		goto err_cleanup;
 	}
 
-	if (cmd != CMD_VERIFY) {
+	if (cmd != CMD_VERIFY && options->inplace) {
+		/* the input file is patched at the end, discard the full copy */
+		outdata = BIO_new(BIO_s_null());
+		BIO_push(hash, outdata);
+	} else if (cmd != CMD_VERIFY) {
 		/* Create outdata file */
 #ifndef WIN32
-		if (!access(options.outfile, R_OK))
+		if (!access(options->outfile, R_OK))
 			/* outdata file exists */
-			DO_EXIT_1("Failed to create file: %s\n", options.outfile);
+			DO_EXIT_1("Failed to create file: %s\n", options->outfile);
 #endif
-		outdata = BIO_new_file(options.outfile, FILE_CREATE_MODE);
+		outdata = BIO_new_file(options->outfile, FILE_CREATE_MODE);
 		if (outdata == NULL)
-			DO_EXIT_1("Failed to create file: %s\n", options.outfile);
+			DO_EXIT_1("Failed to create file: %s\n", options->outfile);
 		if (type == FILE_TYPE_MSI)
 			BIO_push(hash, BIO_new(BIO_s_null()));
 		else
 			BIO_push(hash, outdata);
 	}
 
+	pt = perf_now();
 	if (type == FILE_TYPE_MSI) {
 		if (cmd == CMD_EXTRACT) {
-			ret = msi_extract_file(&msiparams, outdata, options.output_pkcs7);
+			ret = msi_extract_file(&msiparams, outdata, options->output_pkcs7);
 			goto skip_signing;
 		} else if (cmd == CMD_VERIFY) {
-			ret = msi_verify_file(&msiparams, &options);
+			ret = msi_verify_file(&msiparams, options);
 			goto skip_signing;
 		} else {
-			sig = msi_presign_file(type, cmd, &header, &options, &cparams, indata,
+			sig = msi_presign_file(type, cmd, &header, options, cparams, indata,
 				hash, &cursig, &msiparams);
 			if (cmd == CMD_REMOVE) {
 				ret = msi_remove_file(&msiparams, outdata);
@@ -6065,33 +7712,33 @@ int main(int argc, char **argv)
 	} else if (type == FILE_TYPE_CAB) {
 		if (!(header.flags & FLAG_RESERVE_PRESENT) &&
 				(cmd == CMD_REMOVE || cmd == CMD_EXTRACT)) {
-			DO_EXIT_1("CAB file does not have any signature: %s\n", options.infile);
+			DO_EXIT_1("CAB file does not have any signature: %s\n", options->infile);
 		} else if (cmd == CMD_EXTRACT) {
-			ret = cab_extract_file(indata, &header, outdata, options.output_pkcs7);
+			ret = cab_extract_file(indata, &header, outdata, options->output_pkcs7);
 			goto skip_signing;
 		} else if (cmd == CMD_REMOVE) {
 			ret = cab_remove_file(indata, &header, filesize, outdata);
 			goto skip_signing;
 		} else if (cmd == CMD_VERIFY) {
-			ret = cab_verify_file(indata, &header, &options);
+			ret = cab_verify_file(indata, &header, options);
 			goto skip_signing;
 		} else {
-			sig = cab_presign_file(type, cmd, &header, &options, &cparams, indata,
+			sig = cab_presign_file(type, cmd, &header, options, cparams, indata,
 				hash, outdata, &cursig);
 			if (!sig)
 				goto err_cleanup;
 		}
 	} else if (type == FILE_TYPE_PE) {
 		if ((cmd == CMD_REMOVE || cmd == CMD_EXTRACT) && header.sigpos == 0) {
-			DO_EXIT_1("PE file does not have any signature: %s\n", options.infile);
+			DO_EXIT_1("PE file does not have any signature: %s\n", options->infile);
 		} else if (cmd == CMD_EXTRACT) {
-			ret = pe_extract_file(indata, &header, outdata, options.output_pkcs7);
+			ret = pe_extract_file(indata, &header, outdata, options->output_pkcs7);
 			goto skip_signing;
 		} else if (cmd == CMD_VERIFY) {
-			ret = pe_verify_file(indata, &header, &options);
+			ret = pe_verify_file(indata, &header, options);
 			goto skip_signing;
 		} else {
-			sig = pe_presign_file(type, cmd, &header, &options, &cparams, indata,
+			sig = pe_presign_file(type, cmd, &header, options, cparams, indata,
 				hash, outdata, &cursig);
 			if (cmd == CMD_REMOVE) {
 				ret = 0; /* OK */
@@ -6103,26 +7750,29 @@ int main(int argc, char **argv)
 		if (cmd == CMD_REMOVE || cmd == CMD_EXTRACT || (cmd==CMD_ATTACH)) {
 			DO_EXIT_0("Unsupported command\n");
 		} else if (cmd == CMD_VERIFY) {
-			ret = cat_verify_file(catdata, &catheader, indata, &header, filetype, &options);
+			ret = cat_verify_file(catdata, &catheader, indata, &header, filetype, options);
 			goto skip_signing;
 		} else {
-			sig = cat_presign_file(type, cmd, &header, &options, &cparams, indata, &cursig);
+			sig = cat_presign_file(type, cmd, &header, options, cparams, indata, &cursig);
 			if (!sig)
 				goto err_cleanup;
 		}
 	}
+	perf_phase(&perf_stats.presign, pt);
 
 #ifdef ENABLE_CURL
 	/* add counter-signature/timestamp */
-	if (options.nturl && add_timestamp_authenticode(sig, &options))
+	pt = perf_now();
+	if (options->nturl && add_timestamp_authenticode(sig, options))
 		DO_EXIT_2("%s\n%s\n", "Authenticode timestamping failed",
 			"Use the \"-ts\" option to add the RFC3161 Time-Stamp Authority or choose another one Authenticode Time-Stamp Authority");
-	if (options.ntsurl && add_timestamp_rfc3161(sig, &options))
+	if (options->ntsurl && add_timestamp_rfc3161(sig, options))
 		DO_EXIT_2("%s\n%s\n", "RFC 3161 timestamping failed",
 			"Use the \"-t\" option to add the Authenticode Time-Stamp Authority or choose another one RFC3161 Time-Stamp Authority");
+	perf_phase(&perf_stats.timestamp, pt);
 #endif /* ENABLE_CURL */
 
-	if (options.addBlob && !add_unauthenticated_blob(sig))
+	if (options->addBlob && !add_unauthenticated_blob(sig))
 		DO_EXIT_0("Adding unauthenticated blob failed\n");
 
 #if 0
@@ -6130,13 +7780,24 @@ int main(int argc, char **argv)
 		DO_EXIT_0("PKCS7 output failed\n");
 #endif
 
-	ret = append_signature(sig, cursig, type, &options, &msiparams, &padlen, &len, outdata);
+	pt = perf_now();
+	if (options->inplace) {
+		BIO *certtable = BIO_new(BIO_s_mem());
+		ret = append_signature(sig, cursig, type, options, &msiparams, &padlen, &len, certtable);
+		if (!ret)
+			ret = pe_update_signature_inplace(certtable, options, &header, filesize);
+		BIO_free(certtable);
+	} else {
+		ret = append_signature(sig, cursig, type, options, &msiparams, &padlen, &len, outdata);
+	}
+	perf_phase(&perf_stats.append, pt);
 	if (ret)
 		DO_EXIT_0("Append signature to outfile failed\n");
 
 skip_signing:
 
-	update_data_size(type, cmd, &header, padlen, len, outdata);
+	if (!options->inplace)
+		update_data_size(type, cmd, &header, padlen, len, outdata);
 
 	if (type == FILE_TYPE_MSI) {
 		BIO_free_all(outdata);
@@ -6145,12 +7806,14 @@ skip_signing:
 		BIO_free_all(hash);
 		hash = outdata = NULL;
 	}
+	if (perf_stats.enabled && !ret && options->outfile)
+		perf_stats.bytes_out += get_file_size(options->outfile);
 
 	if (!ret && cmd == CMD_ATTACH) {
 		/* reset MSI parameters */
 		free_msi_params(&msiparams);
 		memset(&msiparams, 0, sizeof(MSI_PARAMS));
-		ret = check_attached_data(type, &header, &options, &msiparams);
+		ret = check_attached_data(type, &header, options, &msiparams);
 		if (!ret)
 			printf("Signature successfully attached\n");
 		/* else
@@ -6171,11 +7834,11 @@ err_cleanup:
 			BIO_free_all(outdata);
 			outdata = NULL;
 		}
-		if (options.outfile) {
+		if (options->outfile) {
 #ifdef WIN32
-			_unlink(options.outfile);
+			_unlink(options->outfile);
 #else
-			unlink(options.outfile);
+			unlink(options->outfile);
 #endif /* WIN32 */
 		}
 	}
@@ -6187,6 +7850,844 @@ err_cleanup:
 #endif /* WIN32 */
 	}
 	free_msi_params(&msiparams);
+	OPENSSL_free(options->cachefile);
+	options->cachefile = NULL;
+	OPENSSL_free(options->content_cachefile);
+	options->content_cachefile = NULL;
+	options->cached_digest_len = 0;
+	if (ret)
+		ERR_print_errors_fp(stdout);
+	return ret;
+}
+
+/*
+ * Read the signing manifest into parallel input/output file name arrays,
+ * skipping blank lines and comments
+ */
+static int sign_manifest_read(const char *path, char ***pinfiles, char ***poutfiles, int *pcount)
+{
+	FILE *manifest;
+	char line[4096];
+	char **infiles = NULL, **outfiles = NULL;
+	int count = 0, alloc = 0, lineno = 0, i;
+
+	manifest = fopen(path, "r");
+	if (!manifest) {
+		printf("Failed to open manifest file: %s\n", path);
+		return 0; /* FAILED */
+	}
+	while (fgets(line, sizeof line, manifest)) {
+		char *infile, *outfile, *p;
+
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		/* skip leading whitespace, blank lines and comments */
+		for (infile = line; *infile == ' ' || *infile == '\t'; infile++);
+		if (*infile == '\0' || *infile == '#')
+			continue;
+		p = infile + strcspn(infile, " \t");
+		if (*p != '\0') {
+			*p++ = '\0';
+			for (; *p == ' ' || *p == '\t'; p++);
+		}
+		outfile = p;
+		if (*outfile == '\0') {
+			printf("Manifest line %d: expected <infile> <outfile>\n", lineno);
+			fclose(manifest);
+			for (i = 0; i < count; i++) {
+				OPENSSL_free(infiles[i]);
+				OPENSSL_free(outfiles[i]);
+			}
+			OPENSSL_free(infiles);
+			OPENSSL_free(outfiles);
+			return 0; /* FAILED */
+		}
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			infiles = OPENSSL_realloc(infiles, (size_t)alloc * sizeof(char *));
+			outfiles = OPENSSL_realloc(outfiles, (size_t)alloc * sizeof(char *));
+		}
+		infiles[count] = OPENSSL_strdup(infile);
+		outfiles[count] = OPENSSL_strdup(outfile);
+		count++;
+	}
+	fclose(manifest);
+	*pinfiles = infiles;
+	*poutfiles = outfiles;
+	*pcount = count;
+	return 1; /* OK */
+}
+
+/* Sign one manifest entry and print its report */
+static int sign_batch_file(const char *infile, const char *outfile,
+		GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	int res;
+
+	options->infile = (char *)infile;
+	options->outfile = (char *)outfile;
+	printf("Signing: %s\n", infile);
+	res = process_file(CMD_SIGN, options, cparams);
+	if (res)
+		printf("Failed to sign: %s\n", infile);
+	return res;
+}
+
+/*
+ * Read the verification manifest into an array of file names,
+ * skipping blank lines and comments the same way as batch signing
+ */
+static int verify_manifest_read(const char *path, char ***pfiles, int *pcount)
+{
+	FILE *manifest;
+	char line[4096];
+	char **files = NULL;
+	int count = 0, alloc = 0;
+
+	manifest = fopen(path, "r");
+	if (!manifest) {
+		printf("Failed to open manifest file: %s\n", path);
+		return 0; /* FAILED */
+	}
+	while (fgets(line, sizeof line, manifest)) {
+		char *infile;
+
+		line[strcspn(line, "\r\n")] = '\0';
+		/* skip leading whitespace, blank lines and comments */
+		for (infile = line; *infile == ' ' || *infile == '\t'; infile++);
+		if (*infile == '\0' || *infile == '#')
+			continue;
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			files = OPENSSL_realloc(files, (size_t)alloc * sizeof(char *));
+		}
+		files[count++] = OPENSSL_strdup(infile);
+	}
+	fclose(manifest);
+	*pfiles = files;
+	*pcount = count;
+	return 1; /* OK */
+}
+
+/* Verify one manifest entry and print its report */
+static int verify_batch_file(const char *infile,
+		GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	int res;
+
+	options->infile = (char *)infile;
+	printf("Verifying: %s\n", infile);
+	res = process_file(CMD_VERIFY, options, cparams);
+	if (res)
+		printf("Failed to verify: %s\n", infile);
+	return res;
+}
+
+#ifndef WIN32
+
+/* A pool worker seen from the parent process */
+typedef struct {
+	pid_t pid;
+	int job_fd; /* parent to worker: the next manifest index */
+	int res_fd; /* worker to parent: report, NUL, verdict, perf counters */
+	char *buf;  /* partially received report */
+	size_t len;
+	size_t size;
+	int busy;
+	int file;   /* manifest index being verified */
+} BATCH_WORKER;
+
+/*
+ * Pool worker loop: verify each manifest index received on the job
+ * pipe, writing the report to stdout (already redirected to the result
+ * pipe) terminated with a NUL byte, a one-byte verdict and, with
+ * "-perf-stats", the counters accumulated for the file, so the parent
+ * can fold them into its own summary.  EOF on the job pipe means the
+ * manifest is exhausted.
+ */
+static void verify_batch_worker(int job_fd, char **files, int nfiles,
+		GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	PERF_STATS snap;
+	u_char idx[4], verdict[2];
+	uint32_t file;
+	size_t got;
+	ssize_t nread;
+	int res;
+
+	/* the pool already provides file-level parallelism */
+	options->threads = 1;
+	for (;;) {
+		for (got = 0; got < sizeof idx; got += (size_t)nread) {
+			nread = read(job_fd, idx + got, sizeof idx - got);
+			if (nread <= 0)
+				return;
+		}
+		file = GET_UINT32_LE(idx);
+		if (file >= (uint32_t)nfiles)
+			return;
+		snap = perf_stats;
+		res = verify_batch_file(files[file], options, cparams);
+		fflush(stdout);
+		verdict[0] = '\0';
+		verdict[1] = res ? 1 : 0;
+		if (write(fileno(stdout), verdict, sizeof verdict) != sizeof verdict)
+			return;
+		if (perf_stats.enabled && !perf_stats_send(fileno(stdout), &snap))
+			return;
+	}
+}
+
+/* Hand the next manifest index to an idle worker, or retire it */
+static void batch_dispatch(BATCH_WORKER *worker, int *next, int nfiles)
+{
+	u_char idx[4];
+
+	if (*next >= nfiles || worker->job_fd < 0) {
+		if (worker->job_fd >= 0) {
+			/* no more work: the worker exits on EOF */
+			close(worker->job_fd);
+			worker->job_fd = -1;
+		}
+		return;
+	}
+	PUT_UINT32_LE((uint32_t)*next, idx);
+	if (write(worker->job_fd, idx, sizeof idx) != sizeof idx) {
+		/* a broken pipe is reported as EOF on the result pipe */
+		close(worker->job_fd);
+		worker->job_fd = -1;
+		return;
+	}
+	worker->file = *next;
+	worker->busy = 1;
+	(*next)++;
+}
+
+/*
+ * Verify the manifest with a pool of worker processes.  An idle worker
+ * is handed the next manifest entry as soon as it finishes the previous
+ * one, so a handful of very large inputs does not leave the rest of the
+ * pool idle the way a static partition would.  Each file's report comes
+ * back over the worker's result pipe and is printed as one block in
+ * completion order.  Worker processes are used instead of threads
+ * because the verification report is printed with stdio all the way
+ * down.  Returns -1 if no worker could be started.
+ */
+static int verify_batch_parallel(char **files, int nfiles,
+		GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams, int *verified_files)
+{
+	BATCH_WORKER *workers;
+	struct pollfd *pfds;
+	size_t extra = perf_stats.enabled ? sizeof(PERF_STATS) : 0;
+	int nworkers, alive = 0, next = 0, done = 0, ret = 0, i;
+
+	nworkers = options->threads < nfiles ? options->threads : nfiles;
+	workers = OPENSSL_zalloc((size_t)nworkers * sizeof(BATCH_WORKER));
+	pfds = OPENSSL_malloc((size_t)nworkers * sizeof(struct pollfd));
+
+	for (i = 0; i < nworkers; i++) {
+		int job[2], res[2];
+		pid_t pid;
+
+		workers[i].job_fd = workers[i].res_fd = -1;
+		workers[i].pid = -1;
+		if (pipe(job))
+			continue;
+		if (pipe(res)) {
+			close(job[0]);
+			close(job[1]);
+			continue;
+		}
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) { /* worker process */
+			close(job[1]);
+			close(res[0]);
+			dup2(res[1], fileno(stdout));
+			close(res[1]);
+			verify_batch_worker(job[0], files, nfiles, options, cparams);
+			exit(0);
+		}
+		close(job[0]);
+		close(res[1]);
+		if (pid < 0) {
+			close(job[1]);
+			close(res[0]);
+			continue;
+		}
+		workers[i].pid = pid;
+		workers[i].job_fd = job[1];
+		workers[i].res_fd = res[0];
+		alive++;
+	}
+	if (!alive) {
+		OPENSSL_free(workers);
+		OPENSSL_free(pfds);
+		return -1; /* run sequentially instead */
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].pid >= 0)
+			batch_dispatch(&workers[i], &next, nfiles);
+	}
+	while (done < nfiles && alive > 0) {
+		int nfds = 0;
+
+		for (i = 0; i < nworkers; i++) {
+			if (workers[i].res_fd < 0)
+				continue;
+			pfds[nfds].fd = workers[i].res_fd;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds].revents = 0;
+			nfds++;
+		}
+		if (poll(pfds, (nfds_t)nfds, -1) < 0)
+			continue;
+		for (i = 0; i < nworkers; i++) {
+			BATCH_WORKER *worker = &workers[i];
+			char chunk[4096], *sep;
+			ssize_t nread;
+			int j, hit = 0;
+
+			if (worker->res_fd < 0)
+				continue;
+			for (j = 0; j < nfds; j++) {
+				if (pfds[j].fd == worker->res_fd && pfds[j].revents)
+					hit = 1;
+			}
+			if (!hit)
+				continue;
+			nread = read(worker->res_fd, chunk, sizeof chunk);
+			if (nread <= 0) { /* the worker exited or died */
+				if (worker->busy) {
+					printf("Failed to verify: %s\n", files[worker->file]);
+					ret = 1; /* FAILED */
+					done++;
+				}
+				if (worker->job_fd >= 0)
+					close(worker->job_fd);
+				close(worker->res_fd);
+				worker->job_fd = worker->res_fd = -1;
+				waitpid(worker->pid, NULL, 0);
+				worker->pid = -1;
+				alive--;
+				continue;
+			}
+			if (worker->len + (size_t)nread > worker->size) {
+				worker->size = worker->size ? worker->size * 2 : 2 * sizeof chunk;
+				worker->buf = OPENSSL_realloc(worker->buf, worker->size);
+			}
+			memcpy(worker->buf + worker->len, chunk, (size_t)nread);
+			worker->len += (size_t)nread;
+			/* print every complete report followed by its verdict byte */
+			while ((sep = memchr(worker->buf, '\0', worker->len)) != NULL
+					&& (size_t)(sep - worker->buf) + 1 + extra < worker->len) {
+				size_t report = (size_t)(sep - worker->buf);
+
+				fwrite(worker->buf, 1, report, stdout);
+				if (worker->buf[report + 1])
+					ret = 1; /* FAILED */
+				else
+					(*verified_files)++;
+				if (extra) {
+					PERF_STATS delta;
+
+					memcpy(&delta, worker->buf + report + 2, sizeof delta);
+					perf_stats_merge(&delta);
+				}
+				done++;
+				worker->busy = 0;
+				worker->len -= report + 2 + extra;
+				memmove(worker->buf, worker->buf + report + 2 + extra, worker->len);
+				batch_dispatch(worker, &next, nfiles);
+			}
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].job_fd >= 0)
+			close(workers[i].job_fd);
+		if (workers[i].res_fd >= 0)
+			close(workers[i].res_fd);
+		if (workers[i].pid >= 0)
+			waitpid(workers[i].pid, NULL, 0);
+		OPENSSL_free(workers[i].buf);
+	}
+	OPENSSL_free(workers);
+	OPENSSL_free(pfds);
+	/* verify anything never dispatched (all workers died early) */
+	for (; next < nfiles; next++) {
+		if (verify_batch_file(files[next], options, cparams))
+			ret = 1; /* FAILED */
+		else
+			(*verified_files)++;
+	}
+	return ret;
+}
+
+/*
+ * Pool worker loop for batch signing: the same framing as the
+ * verification pool, with the report of each signed file sent back
+ * as one block
+ */
+static void sign_batch_worker(int job_fd, char **infiles, char **outfiles, int nfiles,
+		GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	PERF_STATS snap;
+	u_char idx[4], verdict[2];
+	uint32_t file;
+	size_t got;
+	ssize_t nread;
+	int res;
+
+	/* the pool already provides file-level parallelism */
+	options->threads = 1;
+	for (;;) {
+		for (got = 0; got < sizeof idx; got += (size_t)nread) {
+			nread = read(job_fd, idx + got, sizeof idx - got);
+			if (nread <= 0)
+				return;
+		}
+		file = GET_UINT32_LE(idx);
+		if (file >= (uint32_t)nfiles)
+			return;
+		snap = perf_stats;
+		res = sign_batch_file(infiles[file], outfiles[file], options, cparams);
+		fflush(stdout);
+		verdict[0] = '\0';
+		verdict[1] = res ? 1 : 0;
+		if (write(fileno(stdout), verdict, sizeof verdict) != sizeof verdict)
+			return;
+		if (perf_stats.enabled && !perf_stats_send(fileno(stdout), &snap))
+			return;
+	}
+}
+
+/*
+ * Sign the manifest with a pool of worker processes.  Each worker signs
+ * one file at a time, so while one worker waits on the Time-Stamp
+ * Authority round-trip the others keep hashing and writing output:
+ * with a pool of n workers up to n timestamp requests are in flight at
+ * once.  As in the verification pool, an idle worker pulls the next
+ * manifest entry and each file's report is printed as one block in
+ * completion order.  A signing failure stops further dispatch, matching
+ * the sequential loop; entries already handed out are still finished
+ * and reported.  Returns -1 if no worker could be started.
+ */
+static int sign_batch_parallel(char **infiles, char **outfiles, int nfiles,
+		GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams, int *signed_files)
+{
+	BATCH_WORKER *workers;
+	struct pollfd *pfds;
+	size_t extra = perf_stats.enabled ? sizeof(PERF_STATS) : 0;
+	int nworkers, alive = 0, next = 0, done = 0, ret = 0, i;
+
+	nworkers = options->threads < nfiles ? options->threads : nfiles;
+	workers = OPENSSL_zalloc((size_t)nworkers * sizeof(BATCH_WORKER));
+	pfds = OPENSSL_malloc((size_t)nworkers * sizeof(struct pollfd));
+
+	for (i = 0; i < nworkers; i++) {
+		int job[2], res[2];
+		pid_t pid;
+
+		workers[i].job_fd = workers[i].res_fd = -1;
+		workers[i].pid = -1;
+		if (pipe(job))
+			continue;
+		if (pipe(res)) {
+			close(job[0]);
+			close(job[1]);
+			continue;
+		}
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) { /* worker process */
+			close(job[1]);
+			close(res[0]);
+			dup2(res[1], fileno(stdout));
+			close(res[1]);
+			sign_batch_worker(job[0], infiles, outfiles, nfiles, options, cparams);
+			exit(0);
+		}
+		close(job[0]);
+		close(res[1]);
+		if (pid < 0) {
+			close(job[1]);
+			close(res[0]);
+			continue;
+		}
+		workers[i].pid = pid;
+		workers[i].job_fd = job[1];
+		workers[i].res_fd = res[0];
+		alive++;
+	}
+	if (!alive) {
+		OPENSSL_free(workers);
+		OPENSSL_free(pfds);
+		return -1; /* run sequentially instead */
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].pid >= 0)
+			batch_dispatch(&workers[i], &next, nfiles);
+	}
+	while (done < nfiles && alive > 0) {
+		int nfds = 0;
+
+		for (i = 0; i < nworkers; i++) {
+			if (workers[i].res_fd < 0)
+				continue;
+			pfds[nfds].fd = workers[i].res_fd;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds].revents = 0;
+			nfds++;
+		}
+		if (poll(pfds, (nfds_t)nfds, -1) < 0)
+			continue;
+		for (i = 0; i < nworkers; i++) {
+			BATCH_WORKER *worker = &workers[i];
+			char chunk[4096], *sep;
+			ssize_t nread;
+			int j, hit = 0;
+
+			if (worker->res_fd < 0)
+				continue;
+			for (j = 0; j < nfds; j++) {
+				if (pfds[j].fd == worker->res_fd && pfds[j].revents)
+					hit = 1;
+			}
+			if (!hit)
+				continue;
+			nread = read(worker->res_fd, chunk, sizeof chunk);
+			if (nread <= 0) { /* the worker exited or died */
+				if (worker->busy) {
+					printf("Failed to sign: %s\n", infiles[worker->file]);
+					ret = 1; /* FAILED */
+					next = nfiles; /* stop handing out new work */
+					done++;
+				}
+				if (worker->job_fd >= 0)
+					close(worker->job_fd);
+				close(worker->res_fd);
+				worker->job_fd = worker->res_fd = -1;
+				waitpid(worker->pid, NULL, 0);
+				worker->pid = -1;
+				alive--;
+				continue;
+			}
+			if (worker->len + (size_t)nread > worker->size) {
+				worker->size = worker->size ? worker->size * 2 : 2 * sizeof chunk;
+				worker->buf = OPENSSL_realloc(worker->buf, worker->size);
+			}
+			memcpy(worker->buf + worker->len, chunk, (size_t)nread);
+			worker->len += (size_t)nread;
+			/* print every complete report followed by its verdict byte */
+			while ((sep = memchr(worker->buf, '\0', worker->len)) != NULL
+					&& (size_t)(sep - worker->buf) + 1 + extra < worker->len) {
+				size_t report = (size_t)(sep - worker->buf);
+
+				fwrite(worker->buf, 1, report, stdout);
+				if (worker->buf[report + 1]) {
+					ret = 1; /* FAILED */
+					next = nfiles; /* stop handing out new work */
+				} else
+					(*signed_files)++;
+				if (extra) {
+					PERF_STATS delta;
+
+					memcpy(&delta, worker->buf + report + 2, sizeof delta);
+					perf_stats_merge(&delta);
+				}
+				done++;
+				worker->busy = 0;
+				worker->len -= report + 2 + extra;
+				memmove(worker->buf, worker->buf + report + 2 + extra, worker->len);
+				batch_dispatch(worker, &next, nfiles);
+			}
+		}
+	}
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].job_fd >= 0)
+			close(workers[i].job_fd);
+		if (workers[i].res_fd >= 0)
+			close(workers[i].res_fd);
+		if (workers[i].pid >= 0)
+			waitpid(workers[i].pid, NULL, 0);
+		OPENSSL_free(workers[i].buf);
+	}
+	OPENSSL_free(workers);
+	OPENSSL_free(pfds);
+	/* sign anything never dispatched (all workers died early) */
+	for (; next < nfiles && !ret; next++) {
+		if (sign_batch_file(infiles[next], outfiles[next], options, cparams))
+			ret = 1; /* FAILED */
+		else
+			(*signed_files)++;
+	}
+	return ret;
+}
+
+#endif /* WIN32 */
+
+/*
+ * Verify every file listed in the manifest file. Unlike batch signing,
+ * a verification failure does not stop the run, so one bad driver does
+ * not hide the results for the rest of the set. The catalog member
+ * index built for the first file is reused for all of them.
+ * With "-threads <n>" greater than one the files are spread over a pool
+ * of worker processes that pull work as they become idle.
+ */
+static int verify_batch(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	char **files = NULL;
+	int nfiles = 0, ret = -1, verified_files = 0, i;
+
+	if (!verify_manifest_read(options->infile, &files, &nfiles))
+		return 1; /* FAILED */
+#ifndef WIN32
+	if (options->threads > 1 && nfiles > 1)
+		ret = verify_batch_parallel(files, nfiles, options, cparams, &verified_files);
+#endif /* WIN32 */
+	if (ret < 0) {
+		ret = 0;
+		for (i = 0; i < nfiles; i++) {
+			if (verify_batch_file(files[i], options, cparams))
+				ret = 1; /* FAILED */
+			else
+				verified_files++;
+		}
+	}
+	/* infile pointed into the manifest array */
+	options->infile = NULL;
+	for (i = 0; i < nfiles; i++)
+		OPENSSL_free(files[i]);
+	OPENSSL_free(files);
+	printf("Successfully verified %d file(s)\n", verified_files);
+	return ret;
+}
+
+/*
+ * Sign every input/output pair listed in the manifest file,
+ * reusing the already-loaded key and certificate chain.
+ * With "-threads <n>" greater than one the entries are spread over a
+ * pool of worker processes, so hashing one file overlaps the Time-Stamp
+ * Authority round-trip of another.  A signing failure stops the run.
+ */
+static int sign_batch(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	char **infiles = NULL, **outfiles = NULL;
+	int nfiles = 0, ret = -1, signed_files = 0, i;
+
+	if (!sign_manifest_read(options->infile, &infiles, &outfiles, &nfiles))
+		return 1; /* FAILED */
+#ifndef WIN32
+	if (options->threads > 1 && nfiles > 1)
+		ret = sign_batch_parallel(infiles, outfiles, nfiles, options, cparams, &signed_files);
+#endif /* WIN32 */
+	if (ret < 0) {
+		ret = 0;
+		for (i = 0; i < nfiles; i++) {
+			if (sign_batch_file(infiles[i], outfiles[i], options, cparams)) {
+				ret = 1; /* FAILED */
+				break;
+			}
+			signed_files++;
+		}
+	}
+	/* infile/outfile pointed into the manifest arrays */
+	options->infile = NULL;
+	options->outfile = NULL;
+	for (i = 0; i < nfiles; i++) {
+		OPENSSL_free(infiles[i]);
+		OPENSSL_free(outfiles[i]);
+	}
+	OPENSSL_free(infiles);
+	OPENSSL_free(outfiles);
+	if (!ret)
+		printf("Successfully signed %d file(s)\n", signed_files);
+	return ret;
+}
+
+#ifndef WIN32
+/*
+ * Parse and run a single job line received over the daemon socket.
+ * Returns 0 on success, 1 on failure and -1 for the "quit" command.
+ */
+static int daemon_run_job(char *line, GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	char *job, *infile, *outfile, *p;
+	int ret;
+
+	/* skip leading whitespace */
+	for (job = line; *job == ' ' || *job == '\t'; job++);
+	if (*job == '\0')
+		return 1; /* FAILED */
+	p = job + strcspn(job, " \t");
+	if (*p != '\0')
+		*p++ = '\0';
+	if (!strcmp(job, "quit"))
+		return -1; /* shut down */
+	for (; *p == ' ' || *p == '\t'; p++);
+	infile = p;
+	p = infile + strcspn(infile, " \t");
+	if (*p != '\0')
+		*p++ = '\0';
+	if (*infile == '\0') {
+		printf("Job \"%s\": expected an input file\n", job);
+		return 1; /* FAILED */
+	}
+	options->infile = infile;
+	if (!strcmp(job, "sign")) {
+		for (; *p == ' ' || *p == '\t'; p++);
+		outfile = p;
+		p = outfile + strcspn(outfile, " \t");
+		*p = '\0';
+		if (*outfile == '\0') {
+			printf("Job \"sign\": expected an output file\n");
+			options->infile = NULL;
+			return 1; /* FAILED */
+		}
+		options->outfile = outfile;
+		printf("Signing: %s\n", infile);
+		ret = process_file(CMD_SIGN, options, cparams) ? 1 : 0;
+	} else if (!strcmp(job, "verify")) {
+		printf("Verifying: %s\n", infile);
+		ret = process_file(CMD_VERIFY, options, cparams) ? 1 : 0;
+	} else {
+		printf("Unknown job: %s\n", job);
+		ret = 1; /* FAILED */
+	}
+	/* infile/outfile pointed into the receive buffer */
+	options->infile = NULL;
+	options->outfile = NULL;
+	return ret;
+}
+
+/*
+ * Serve sign and verify jobs over a unix socket, keeping the loaded key,
+ * the certificate chain and any engine/token session warm between jobs.
+ * Every connection carries one newline-terminated job request and gets
+ * an "OK" or "FAILED" reply.
+ */
+static int sign_daemon(GLOBAL_OPTIONS *options, CRYPTO_PARAMS *cparams)
+{
+	struct sockaddr_un addr;
+	int sock, ret = 1, jobs = 0;
+
+	if (strlen(options->socketpath) >= sizeof addr.sun_path) {
+		printf("Socket path is too long: %s\n", options->socketpath);
+		return 1; /* FAILED */
+	}
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		printf("Failed to create a socket\n");
+		return 1; /* FAILED */
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, options->socketpath);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof addr) || listen(sock, 16)) {
+		printf("Failed to listen on socket: %s\n", options->socketpath);
+		close(sock);
+		return 1; /* FAILED */
+	}
+	printf("Accepting jobs on %s\n", options->socketpath);
+	for (;;) {
+		char line[4096];
+		size_t len = 0;
+		ssize_t nread;
+		int conn, res;
+
+		conn = accept(sock, NULL, NULL);
+		if (conn < 0)
+			continue;
+		/* read a single newline-terminated job request */
+		while (len < sizeof line - 1) {
+			nread = read(conn, line + len, sizeof line - 1 - len);
+			if (nread <= 0)
+				break;
+			len += (size_t)nread;
+			if (memchr(line, '\n', len))
+				break;
+		}
+		line[len] = '\0';
+		line[strcspn(line, "\r\n")] = '\0';
+		res = daemon_run_job(line, options, cparams);
+		if (write(conn, res > 0 ? "FAILED\n" : "OK\n", res > 0 ? 7 : 3) < 0)
+			printf("Failed to send a reply\n");
+		close(conn);
+		if (res < 0) {
+			ret = 0; /* OK */
+			break;
+		}
+		if (!res)
+			jobs++;
+	}
+	close(sock);
+	unlink(options->socketpath);
+	printf("Successfully processed %d job(s)\n", jobs);
+	return ret;
+}
+#endif /* WIN32 */
+
+int main(int argc, char **argv)
+{
+	GLOBAL_OPTIONS options;
+	CRYPTO_PARAMS cparams;
+	int ret = -1;
+	cmd_type_t cmd = CMD_SIGN;
+
+	/* reset options */
+	memset(&options, 0, sizeof(GLOBAL_OPTIONS));
+	perf_stats.start = perf_now();
+
+	/* Set up OpenSSL */
+	if (!OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS
+			| OPENSSL_INIT_ADD_ALL_CIPHERS
+			| OPENSSL_INIT_ADD_ALL_DIGESTS
+			| OPENSSL_INIT_LOAD_CONFIG, NULL))
+		DO_EXIT_0("Failed to init crypto\n");
+
+	/* create some MS Authenticode OIDS we need later on */
+	if (!OBJ_create(SPC_STATEMENT_TYPE_OBJID, NULL, NULL) ||
+			!OBJ_create(MS_JAVA_SOMETHING, NULL, NULL) ||
+			!OBJ_create(SPC_SP_OPUS_INFO_OBJID, NULL, NULL) ||
+			!OBJ_create(SPC_NESTED_SIGNATURE_OBJID, NULL, NULL))
+		DO_EXIT_0("Failed to create objects\n");
+
+	/* reset crypto */
+	memset(&cparams, 0, sizeof(CRYPTO_PARAMS));
+
+	/* commands and options initialization */
+	if (!main_configure(argc, argv, &cmd, &options))
+		goto err_cleanup;
+	if (!read_password(&options)) {
+		printf("Failed to read password from file: %s\n", options.readpass);
+		goto err_cleanup;
+	}
+
+	/* read key and certificates */
+	if ((cmd == CMD_SIGN || cmd == CMD_SIGN_BATCH || cmd == CMD_DAEMON)
+			&& !read_crypto_params(&options, &cparams))
+		goto err_cleanup;
+
+	if (cmd == CMD_SIGN_BATCH)
+		ret = sign_batch(&options, &cparams);
+	else if (cmd == CMD_VERIFY_BATCH)
+		ret = verify_batch(&options, &cparams);
+	else if (cmd == CMD_DAEMON)
+#ifndef WIN32
+		ret = sign_daemon(&options, &cparams);
+#else
+		DO_EXIT_0("Daemon mode is not supported on this platform\n");
+#endif /* WIN32 */
+	else
+		ret = process_file(cmd, &options, &cparams);
+
+err_cleanup:
+#ifdef ENABLE_CURL
+	ts_pool_cleanup();
+#endif /* ENABLE_CURL */
+	cat_index_free();
+	store_cache_cleanup();
+	md_cache_cleanup();
 	free_crypto_params(&cparams);
 	free_options(&options);
 	if (ret)
@@ -6195,6 +8696,8 @@ err_cleanup:
 		ret = 0; /* OK */
 	else
 		printf(ret ? "Failed\n" : "Succeeded\n");
+	if (perf_stats.enabled)
+		perf_stats_report();
 	return ret;
 }
 